@@ -0,0 +1,556 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2020-2023 katursis
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// Microbenchmarks of the plugin hot paths, run against the mock AMX host.
+// Results are printed as JSON in the Google Benchmark layout, so two runs
+// can be compared with its tools/compare.py.
+//
+//   ptl_bench [--filter=substring] [--min-time=seconds] [--out=file.json]
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <functional>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "../ptl.h"
+#include "../mock/amx_host.h"
+
+namespace {
+template <typename T>
+inline void Consume(const T &value) {
+#if defined __GNUC__ || defined __clang__
+  asm volatile("" : : "r,m"(value) : "memory");
+#else
+  static volatile const void *sink;
+  sink = &value;
+#endif
+}
+
+class Script : public ptl::AbstractScript<Script> {
+ public:
+  cell n_Empty() { return 1; }
+
+  cell n_Cell(cell value) { return value; }
+
+  cell n_Float(float value) { return static_cast<cell>(value); }
+
+  cell n_Ref(cell *ref) { return *ref; }
+
+  cell n_String(std::string str) { return static_cast<cell>(str.size()); }
+
+  cell n_StringRef(ptl::AmxStringBuffer str) {
+    return static_cast<cell>(str.Size());
+  }
+
+  cell n_StringView(std::string_view str) {
+    return static_cast<cell>(str.size());
+  }
+
+  cell n_Span(ptl::Span<cell> arr) { return static_cast<cell>(arr.Size()); }
+
+  cell n_OutString(ptl::OutString out) {
+    out.Write("result");
+
+    return static_cast<cell>(out.Length());
+  }
+
+  cell n_Mixed(int a, float b, cell *ref, ptl::AmxStringBuffer str) {
+    return a + static_cast<cell>(b) + *ref + static_cast<cell>(str.Size());
+  }
+};
+
+class Plugin : public ptl::AbstractPlugin<Plugin, Script> {
+ public:
+  const char *Name() { return "ptl_bench"; }
+
+  bool OnLoad() {
+    RegisterNative<&Script::n_Empty>("n_Empty");
+    RegisterNative<&Script::n_Cell>("n_Cell");
+    RegisterNative<&Script::n_Float>("n_Float");
+    RegisterNative<&Script::n_Ref>("n_Ref");
+    RegisterNative<&Script::n_String>("n_String");
+    RegisterNative<&Script::n_StringRef>("n_StringRef");
+    RegisterNative<&Script::n_StringView>("n_StringView");
+    RegisterNative<&Script::n_Span>("n_Span");
+    RegisterNative<&Script::n_OutString>("n_OutString");
+    RegisterNative<&Script::n_Mixed>("n_Mixed");
+
+    return true;
+  }
+
+  void OnUnload() {}
+};
+
+// Loaded scripts, all built from the same spec
+class Scripts {
+ public:
+  explicit Scripts(ptl::mock::Host &host) : host_{host} {
+    spec_.natives = {"n_Empty",      "n_Cell",      "n_Float",
+                     "n_Ref",        "n_String",    "n_StringRef",
+                     "n_StringView", "n_Span",      "n_OutString",
+                     "n_Mixed"};
+    spec_.publics = {{"OnBench", [](ptl::mock::AmxScript &, cell *params) {
+                        return params[0];
+                      }}};
+    spec_.pubvars = {{"gPlayerCount", 100}};
+    spec_.data_cells = 1024;
+    spec_.stack_cells = 64 * 1024;
+  }
+
+  ~Scripts() { Resize(0); }
+
+  void Resize(std::size_t count) {
+    while (scripts_.size() < count) {
+      auto &script = host_.LoadScript(spec_);
+
+      Plugin::DoAmxLoad(script.GetAmx());
+
+      scripts_.push_back(&script);
+    }
+
+    while (scripts_.size() > count) {
+      auto script = scripts_.back();
+
+      Plugin::DoAmxUnload(script->GetAmx());
+      host_.UnloadScript(*script);
+
+      scripts_.pop_back();
+    }
+  }
+
+  inline ptl::mock::AmxScript &operator[](std::size_t index) {
+    return *scripts_[index];
+  }
+
+  inline std::size_t Size() const { return scripts_.size(); }
+
+ private:
+  ptl::mock::Host &host_;
+  ptl::mock::AmxScriptSpec spec_;
+  std::vector<ptl::mock::AmxScript *> scripts_;
+};
+
+// A native call with its parameters pushed once, like SYSREQ would do
+class NativeCall {
+ public:
+  NativeCall(ptl::mock::AmxScript &script, const char *name,
+             std::vector<cell> args)
+      : amx_{script.GetAmx()}, stk_{amx_->stk} {
+    auto hdr = script.GetHeader();
+
+    for (int i = 0; i < script.NumEntries(hdr->natives, hdr->libraries); ++i) {
+      auto stub = script.Stub(hdr->natives, i);
+
+      if (!std::strcmp(script.EntryName(stub), name)) {
+        func_ = script.native_funcs_.at(stub->address - 1);
+      }
+    }
+
+    if (!func_) {
+      throw std::runtime_error{std::string{"no native "} + name};
+    }
+
+    for (auto arg = args.rbegin(); arg != args.rend(); ++arg) {
+      script.Push(*arg);
+    }
+
+    script.Push(static_cast<cell>(args.size() * sizeof(cell)));
+
+    params_ = script.PhysAddr(amx_->stk);
+  }
+
+  ~NativeCall() { amx_->stk = stk_; }
+
+  inline cell operator()() { return func_(amx_, params_); }
+
+ private:
+  AMX *amx_{};
+  cell stk_{};
+  AMX_NATIVE func_{};
+  cell *params_{};
+};
+
+struct Benchmark {
+  std::string name;
+  // Prepares the state and returns the measured loop
+  std::function<std::function<void(std::size_t iterations)>()> setup;
+};
+
+struct Result {
+  std::string name;
+  std::size_t iterations;
+  double ns_per_op;
+};
+
+Result Run(const Benchmark &benchmark, double min_time) {
+  auto loop = benchmark.setup();
+
+  auto measure = [&loop](std::size_t iterations) {
+    auto start = std::chrono::steady_clock::now();
+
+    loop(iterations);
+
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                         start)
+        .count();
+  };
+
+  // Grow the iteration count until one run takes long enough
+  std::size_t iterations = 1;
+  double elapsed = measure(iterations);
+
+  while (elapsed < min_time && iterations < (std::size_t{1} << 40)) {
+    double factor = elapsed > 0 ? min_time * 1.4 / elapsed : 100;
+
+    iterations = static_cast<std::size_t>(
+        iterations * std::min(std::max(factor, 2.0), 100.0));
+    elapsed = measure(iterations);
+  }
+
+  // Median of three
+  double runs[3] = {elapsed, measure(iterations), measure(iterations)};
+
+  std::sort(std::begin(runs), std::end(runs));
+
+  return {benchmark.name, iterations, runs[1] * 1e9 / iterations};
+}
+
+std::string JsonEscape(const std::string &str) {
+  std::string result;
+
+  for (char c : str) {
+    if (c == '"' || c == '\\') {
+      result += '\\';
+    }
+
+    result += c;
+  }
+
+  return result;
+}
+
+void WriteJson(std::FILE *out, const std::vector<Result> &results) {
+  char date[64]{};
+  std::time_t now = std::time(nullptr);
+
+  std::strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", std::localtime(&now));
+
+  std::fprintf(out, "{\n  \"context\": {\n");
+  std::fprintf(out, "    \"date\": \"%s\",\n", date);
+  std::fprintf(out, "    \"string_kernels\": \"%s\",\n",
+               ptl::StringKernels::Isa());
+  std::fprintf(out, "    \"stats_enabled\": %s,\n",
+               ptl::Stats::enabled ? "true" : "false");
+#ifdef NDEBUG
+  std::fprintf(out, "    \"library_build_type\": \"release\"\n");
+#else
+  std::fprintf(out, "    \"library_build_type\": \"debug\"\n");
+#endif
+  std::fprintf(out, "  },\n  \"benchmarks\": [\n");
+
+  for (std::size_t i = 0; i < results.size(); ++i) {
+    std::fprintf(out,
+                 "    {\"name\": \"%s\", \"run_type\": \"iteration\", "
+                 "\"iterations\": %zu, \"real_time\": %.3f, "
+                 "\"cpu_time\": %.3f, \"time_unit\": \"ns\"}%s\n",
+                 JsonEscape(results[i].name).c_str(), results[i].iterations,
+                 results[i].ns_per_op, results[i].ns_per_op,
+                 i + 1 < results.size() ? "," : "");
+  }
+
+  std::fprintf(out, "  ]\n}\n");
+}
+
+std::vector<Benchmark> MakeBenchmarks(Scripts &scripts) {
+  std::vector<Benchmark> benchmarks;
+
+  // NativeGenerator::Native per parameter type
+  auto native = [&](const std::string &name, const char *native_name,
+                    std::function<std::vector<cell>(ptl::mock::AmxScript &)>
+                        make_args) {
+    benchmarks.push_back({"native/" + name, [&scripts, native_name,
+                                             make_args] {
+                            scripts.Resize(1);
+
+                            auto call = std::make_shared<NativeCall>(
+                                scripts[0], native_name,
+                                make_args(scripts[0]));
+
+                            return [call](std::size_t iterations) {
+                              for (std::size_t i = 0; i < iterations; ++i) {
+                                Consume((*call)());
+                              }
+                            };
+                          }});
+  };
+
+  native("empty", "n_Empty", [](auto &) { return std::vector<cell>{}; });
+  native("cell", "n_Cell", [](auto &) { return std::vector<cell>{42}; });
+  native("float", "n_Float", [](auto &) {
+    return std::vector<cell>{ptl::FloatToCell(1.5f)};
+  });
+  native("ref", "n_Ref",
+         [](auto &script) { return std::vector<cell>{script.Allot(1)}; });
+  native("string/16", "n_String", [](auto &script) {
+    return std::vector<cell>{script.AllotString("0123456789abcdef")};
+  });
+  native("string_ref/16", "n_StringRef", [](auto &script) {
+    return std::vector<cell>{script.AllotString("0123456789abcdef")};
+  });
+  native("string_view/16", "n_StringView", [](auto &script) {
+    return std::vector<cell>{script.AllotString("0123456789abcdef")};
+  });
+  native("span/64", "n_Span", [](auto &script) {
+    return std::vector<cell>{script.Allot(64), 64};
+  });
+  native("out_string/32", "n_OutString", [](auto &script) {
+    return std::vector<cell>{script.Allot(32), 32};
+  });
+  native("mixed/4", "n_Mixed", [](auto &script) {
+    return std::vector<cell>{7, ptl::FloatToCell(2.5f), script.Allot(1),
+                             script.AllotString("text")};
+  });
+
+  // GetScriptImpl: the same script every call (cached) and round-robin
+  for (std::size_t count : {1, 10, 50}) {
+    benchmarks.push_back(
+        {"get_script/round_robin/" + std::to_string(count),
+         [&scripts, count] {
+           scripts.Resize(count);
+
+           std::vector<AMX *> amxs;
+
+           for (std::size_t i = 0; i < count; ++i) {
+             amxs.push_back(scripts[i].GetAmx());
+           }
+
+           return [amxs](std::size_t iterations) {
+             for (std::size_t i = 0; i < iterations; ++i) {
+               Consume(&Plugin::GetScript(amxs[i % amxs.size()]));
+             }
+           };
+         }});
+  }
+
+  benchmarks.push_back({"get_script/same", [&scripts] {
+                          scripts.Resize(10);
+
+                          AMX *amx = scripts[5].GetAmx();
+
+                          return [amx](std::size_t iterations) {
+                            for (std::size_t i = 0; i < iterations; ++i) {
+                              Consume(&Plugin::GetScript(amx));
+                            }
+                          };
+                        }});
+
+  // AbstractScript::GetString by length
+  for (std::size_t length : {8, 64, 512, 4096}) {
+    benchmarks.push_back(
+        {"get_string/" + std::to_string(length), [&scripts, length] {
+           scripts.Resize(1);
+
+           std::string text(length, 'x');
+           cell amx_addr = scripts[0].AllotString(text.c_str());
+           Script *script = &Plugin::GetScript(scripts[0].GetAmx());
+
+           return [script, amx_addr](std::size_t iterations) {
+             for (std::size_t i = 0; i < iterations; ++i) {
+               Consume(script->GetString(amx_addr));
+             }
+           };
+         }});
+  }
+
+  // Polling a public variable through a PublicVar and by name
+  benchmarks.push_back({"public_var/get", [&scripts] {
+                          scripts.Resize(1);
+
+                          auto var = Plugin::GetScript(scripts[0].GetAmx())
+                                         .GetPublicVar("gPlayerCount");
+
+                          return [var](std::size_t iterations) {
+                            for (std::size_t i = 0; i < iterations; ++i) {
+                              Consume(var.Get());
+                            }
+                          };
+                        }});
+  benchmarks.push_back(
+      {"public_var/by_name", [&scripts] {
+         scripts.Resize(1);
+
+         Script *script = &Plugin::GetScript(scripts[0].GetAmx());
+
+         return [script](std::size_t iterations) {
+           for (std::size_t i = 0; i < iterations; ++i) {
+             Consume(script->GetPublicVarValue("gPlayerCount"));
+           }
+         };
+       }});
+
+  // Public::Exec with 0-8 arguments
+  auto exec = [&](const std::string &name, auto call) {
+    benchmarks.push_back({"public_exec/" + name, [&scripts, call] {
+                            scripts.Resize(1);
+
+                            auto pub = Plugin::GetScript(scripts[0].GetAmx())
+                                           .MakePublic("OnBench");
+
+                            return [pub, call](std::size_t iterations) {
+                              for (std::size_t i = 0; i < iterations; ++i) {
+                                Consume(call(*pub));
+                              }
+                            };
+                          }});
+  };
+
+  exec("ints/0", [](ptl::Public &pub) { return pub.Exec(); });
+  exec("ints/1", [](ptl::Public &pub) { return pub.Exec(1); });
+  exec("ints/2", [](ptl::Public &pub) { return pub.Exec(1, 2); });
+  exec("ints/4", [](ptl::Public &pub) { return pub.Exec(1, 2, 3, 4); });
+  exec("ints/8",
+       [](ptl::Public &pub) { return pub.Exec(1, 2, 3, 4, 5, 6, 7, 8); });
+  exec("strings/1", [](ptl::Public &pub) { return pub.Exec("text"); });
+  exec("strings/2", [](ptl::Public &pub) { return pub.Exec("a", "text"); });
+  exec("strings/4", [](ptl::Public &pub) {
+    return pub.Exec("a", "text", "b", "text");
+  });
+  exec("strings/8", [](ptl::Public &pub) {
+    return pub.Exec("a", "text", "b", "text", "c", "text", "d", "text");
+  });
+  exec("mixed/8", [](ptl::Public &pub) {
+    return pub.Exec(1, "text", 2.5f, std::string("string"), 3, "a", 4.5f, 5);
+  });
+
+  // EveryScript and PublicBroadcast fan-out
+  for (std::size_t count : {1, 10, 50}) {
+    benchmarks.push_back(
+        {"every_script/" + std::to_string(count), [&scripts, count] {
+           scripts.Resize(count);
+
+           return [](std::size_t iterations) {
+             for (std::size_t i = 0; i < iterations; ++i) {
+               Plugin::EveryScript([](const auto &script) {
+                 Consume(script.get());
+
+                 return true;
+               });
+             }
+           };
+         }});
+
+    benchmarks.push_back(
+        {"broadcast/" + std::to_string(count), [&scripts, count] {
+           scripts.Resize(count);
+
+           auto broadcast =
+               std::make_shared<Plugin::PublicBroadcast<int, int>>("OnBench");
+
+           return [broadcast](std::size_t iterations) {
+             for (std::size_t i = 0; i < iterations; ++i) {
+               Consume(broadcast->Exec(1, 2));
+             }
+           };
+         }});
+  }
+
+  return benchmarks;
+}
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  std::string filter;
+  std::string out_path;
+  double min_time = 0.2;
+
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+
+    if (arg.rfind("--filter=", 0) == 0) {
+      filter = arg.substr(9);
+    } else if (arg.rfind("--min-time=", 0) == 0) {
+      min_time = std::stod(arg.substr(11));
+    } else if (arg.rfind("--out=", 0) == 0) {
+      out_path = arg.substr(6);
+    } else {
+      std::fprintf(stderr,
+                   "usage: %s [--filter=substring] [--min-time=seconds] "
+                   "[--out=file.json]\n",
+                   argv[0]);
+
+      return 1;
+    }
+  }
+
+  ptl::mock::Host host;
+
+  if (!Plugin::DoLoad(host.PluginData())) {
+    std::fprintf(stderr, "plugin failed to load\n");
+
+    return 1;
+  }
+
+  std::vector<Result> results;
+
+  {
+    Scripts scripts{host};
+
+    for (const auto &benchmark : MakeBenchmarks(scripts)) {
+      if (benchmark.name.find(filter) == std::string::npos) {
+        continue;
+      }
+
+      results.push_back(Run(benchmark, min_time));
+
+      const Result &result = results.back();
+
+      std::fprintf(stderr, "%-32s %12.1f ns %14zu\n", result.name.c_str(),
+                   result.ns_per_op, result.iterations);
+    }
+  }
+
+  Plugin::DoUnload();
+
+  std::FILE *out =
+      out_path.empty() ? stdout : std::fopen(out_path.c_str(), "w");
+
+  if (!out) {
+    std::fprintf(stderr, "can't open %s\n", out_path.c_str());
+
+    return 1;
+  }
+
+  WriteJson(out, results);
+
+  if (out != stdout) {
+    std::fclose(out);
+  }
+
+  return 0;
+}
@@ -0,0 +1,1219 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2020-2023 katursis
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// Behavioural checks of the library against the mock AMX host, run by ctest
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../ptl.h"
+#include "../mock/amx_host.h"
+
+namespace {
+int failures{};
+
+#define CHECK(cond)                                                \
+  do {                                                             \
+    if (!(cond)) {                                                 \
+      std::printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, \
+                  #cond);                                          \
+      ++failures;                                                  \
+    }                                                              \
+  } while (0)
+
+struct Timer {
+  explicit Timer(int interval) : interval{interval} { ++alive; }
+
+  ~Timer() { --alive; }
+
+  int interval{};
+
+  inline static int alive{};
+};
+
+class Script : public ptl::AbstractScript<Script> {
+ public:
+  cell n_Add(int a, float b, cell *ref, std::string str,
+             std::string_view view) {
+    *ref = a;
+
+    return a + static_cast<cell>(b) + static_cast<cell>(str.size()) +
+           static_cast<cell>(view.size());
+  }
+
+  cell n_Sum(ptl::Span<cell> arr) {
+    cell sum{};
+
+    for (cell value : arr) {
+      sum += value;
+    }
+
+    return sum;
+  }
+
+  cell n_Format(ptl::OutString out, int value) {
+    out.Printf("value=%d", value);
+
+    return static_cast<cell>(out.Length());
+  }
+
+  cell n_CreateTimer(int interval) { return MakeHandle<Timer>(interval); }
+
+  cell n_TimerInterval(ptl::Handle<Timer> timer) { return timer->interval; }
+
+  cell n_DestroyTimer(ptl::Handle<Timer> &timer) {
+    return ptl::HandleTable<Timer>::Instance().Release(timer.Value());
+  }
+
+  // Only Handle<T> parameters are handles, other references are plain
+  // parameters
+  cell n_FormatRef(ptl::OutString &out, int value) {
+    return n_Format(out, value);
+  }
+
+  cell n_SumRef(ptl::Span<cell> &arr) { return n_Sum(arr); }
+
+  // -1 if the decoded string is not terminated right after its last character
+  cell n_StrSize(ptl::AmxStringBuffer str) {
+    if (std::strlen(str.Data()) != str.Size()) {
+      return -1;
+    }
+
+    return static_cast<cell>(str.Size());
+  }
+};
+
+class Plugin : public ptl::AbstractPlugin<Plugin, Script> {
+ public:
+  const char *Name() { return "ptl_test"; }
+
+  int AmxErrorLogRate() { return 3; }
+
+  bool LogUnresolvedNatives() { return true; }
+
+  bool OnLoad() {
+    RegisterNative<&Script::n_Add>("Add");
+    RegisterNative<&Script::n_Sum>("Sum");
+    RegisterNative<&Script::n_Format>("Format");
+    RegisterNative<&Script::n_CreateTimer>("CreateTimer");
+    RegisterNative<&Script::n_TimerInterval>("TimerInterval");
+    RegisterNative<&Script::n_DestroyTimer>("DestroyTimer");
+    RegisterNative<&Script::n_FormatRef>("FormatRef");
+    RegisterNative<&Script::n_SumRef>("SumRef");
+    RegisterNative<&Script::n_StrSize>("StrSize");
+    RegisterNative<&Plugin::n_DumpStats>("PTL_DumpStats");
+
+    return true;
+  }
+
+  void OnUnload() {}
+
+  // Scratch memory taken by every script on each tick
+  void OnProcessTick() {
+    EveryScript([](const std::shared_ptr<Script> &script) {
+      script->Scratch().Allocate(tick_scratch_bytes);
+
+      return true;
+    });
+  }
+
+  inline static std::size_t tick_scratch_bytes{};
+};
+
+// Calls that reached the exported AMX functions, hooked the way another
+// plugin would hook them
+int export_calls[PLUGIN_AMX_EXPORT_UTF8Put + 1]{};
+
+int AMXAPI HookedGetAddr(AMX *amx, cell amx_addr, cell **phys_addr) {
+  ++export_calls[PLUGIN_AMX_EXPORT_GetAddr];
+
+  return ptl::mock::api::GetAddr(amx, amx_addr, phys_addr);
+}
+
+int AMXAPI HookedPush(AMX *amx, cell value) {
+  ++export_calls[PLUGIN_AMX_EXPORT_Push];
+
+  return ptl::mock::api::Push(amx, value);
+}
+
+int AMXAPI HookedRelease(AMX *amx, cell amx_addr) {
+  ++export_calls[PLUGIN_AMX_EXPORT_Release];
+
+  return ptl::mock::api::Release(amx, amx_addr);
+}
+
+int AMXAPI HookedStrLen(const cell *cstring, int *length) {
+  ++export_calls[PLUGIN_AMX_EXPORT_StrLen];
+
+  return ptl::mock::api::StrLen(cstring, length);
+}
+
+int AMXAPI HookedFindPublic(AMX *amx, const char *name, int *index) {
+  ++export_calls[PLUGIN_AMX_EXPORT_FindPublic];
+
+  return ptl::mock::api::FindPublic(amx, name, index);
+}
+
+void HookExports(ptl::mock::Host &host) {
+  auto exports =
+      static_cast<void **>(host.PluginData()[PLUGIN_DATA_AMX_EXPORTS]);
+
+  exports[PLUGIN_AMX_EXPORT_GetAddr] = reinterpret_cast<void *>(HookedGetAddr);
+  exports[PLUGIN_AMX_EXPORT_Push] = reinterpret_cast<void *>(HookedPush);
+  exports[PLUGIN_AMX_EXPORT_Release] = reinterpret_cast<void *>(HookedRelease);
+  exports[PLUGIN_AMX_EXPORT_StrLen] = reinterpret_cast<void *>(HookedStrLen);
+  exports[PLUGIN_AMX_EXPORT_FindPublic] =
+      reinterpret_cast<void *>(HookedFindPublic);
+}
+
+// Same scripts, AMX calls done inline
+class InlinePlugin : public ptl::AbstractPlugin<InlinePlugin, Script> {
+ public:
+  const char *Name() { return "ptl_test_inline"; }
+
+  bool InlineAmxCalls() { return true; }
+
+  void OnUnload() {}
+};
+
+ptl::mock::AmxScriptSpec MakeSpec() {
+  ptl::mock::AmxScriptSpec spec;
+
+  spec.natives = {"Add", "Sum", "Format", "CreateTimer", "TimerInterval",
+                  "DestroyTimer", "FormatRef", "SumRef", "StrSize",
+                  "PTL_DumpStats"};
+
+  return spec;
+}
+
+std::size_t CountLog(ptl::mock::Host &host, const char *text) {
+  std::size_t count{};
+
+  for (const auto &line : host.Log()) {
+    count += line.find(text) != std::string::npos;
+  }
+
+  return count;
+}
+
+// A callback that loads and unloads scripts and runs the same broadcast again
+void TestBroadcastRefresh(ptl::mock::Host &host) {
+  static Plugin::PublicBroadcast<int> broadcast{"OnEvent"};
+  static std::vector<ptl::mock::AmxScript *> scripts;
+  static int calls{};
+  static auto spec = MakeSpec();
+
+  spec.publics = {{"OnEvent", [&host](ptl::mock::AmxScript &self,
+                                      cell *params) {
+                     ++calls;
+
+                     if (params[1] == 1) {
+                       auto other = scripts[0] == &self ? scripts[1]
+                                                        : scripts[0];
+
+                       Plugin::DoAmxUnload(other->GetAmx());
+
+                       auto &loaded = host.LoadScript(spec);
+
+                       Plugin::DoAmxLoad(loaded.GetAmx());
+                       scripts.push_back(&loaded);
+
+                       broadcast.Exec(2);
+                     }
+
+                     return params[1];
+                   }}};
+
+  for (int i = 0; i < 2; ++i) {
+    scripts.push_back(&host.LoadScript(spec));
+    Plugin::DoAmxLoad(scripts.back()->GetAmx());
+  }
+
+  // The outer call runs the first script only: the other one is unloaded by
+  // then, the new one was covered by the nested call
+  CHECK(broadcast.Exec(1) == 1);
+  CHECK(calls == 3);
+
+  for (auto script : scripts) {
+    Plugin::DoAmxUnload(script->GetAmx());
+    host.UnloadScript(*script);
+  }
+}
+
+// Each AMX finds its own script, also right after another one was looked up,
+// and an unloaded one is gone from the index
+void TestScriptLookup(ptl::mock::Host &host) {
+  auto &first = host.LoadScript(MakeSpec());
+  auto &second = host.LoadScript(MakeSpec());
+
+  Plugin::DoAmxLoad(first.GetAmx());
+  Plugin::DoAmxLoad(second.GetAmx());
+
+  for (int i = 0; i < 3; ++i) {
+    CHECK(Plugin::GetScript(first.GetAmx()).GetAmx()->GetPtr() ==
+          first.GetAmx());
+    CHECK(Plugin::GetScript(second.GetAmx()).GetAmx()->GetPtr() ==
+          second.GetAmx());
+  }
+
+  // Unloaded while it is the last script looked up
+  Plugin::GetScript(first.GetAmx());
+  Plugin::DoAmxUnload(first.GetAmx());
+
+  bool thrown{};
+
+  try {
+    Plugin::GetScript(first.GetAmx());
+  } catch (const std::runtime_error &e) {
+    thrown = std::string{e.what()} == "Script not found";
+  }
+
+  CHECK(thrown);
+  CHECK(Plugin::GetScript(second.GetAmx()).GetAmx()->GetPtr() ==
+        second.GetAmx());
+
+  Plugin::DoAmxUnload(second.GetAmx());
+  host.UnloadScript(second);
+  host.UnloadScript(first);
+}
+
+// Every string argument of a call is freed, with one amx_Release
+void TestPublicStrings(ptl::mock::Host &host) {
+  std::vector<std::string> received;
+  auto spec = MakeSpec();
+
+  spec.publics = {{"OnStrings", [&received](ptl::mock::AmxScript &self,
+                                            cell *params) {
+                     auto &script = Plugin::GetScript(self.GetAmx());
+
+                     received.clear();
+
+                     for (cell i = 1; i <= 3; ++i) {
+                       received.push_back(script.GetString(params[i]));
+                     }
+
+                     return params[4];
+                   }}};
+
+  auto &amx_script = host.LoadScript(spec);
+  AMX *amx = amx_script.GetAmx();
+
+  Plugin::DoAmxLoad(amx);
+
+  auto pub = Plugin::GetScript(amx).MakePublic("OnStrings");
+  cell hea = amx->hea;
+  int releases = export_calls[PLUGIN_AMX_EXPORT_Release];
+  const char *null_str{};
+
+  CHECK(pub->Exec("one", std::string{"two"}, null_str, 4) == 4);
+  CHECK(received == (std::vector<std::string>{"one", "two", ""}));
+  CHECK(amx->hea == hea);
+  CHECK(export_calls[PLUGIN_AMX_EXPORT_Release] == releases + 1);
+
+  // Arguments pushed one by one are released the same way
+  pub->Push(5);
+  pub->Push("six");
+  pub->Push(std::string{"seven"});
+  pub->Push("eight");
+  CHECK(pub->Exec() == 5);
+  CHECK(received == (std::vector<std::string>{"eight", "seven", "six"}));
+  CHECK(amx->hea == hea);
+  CHECK(export_calls[PLUGIN_AMX_EXPORT_Release] == releases + 2);
+
+  Plugin::DoAmxUnload(amx);
+  host.UnloadScript(amx_script);
+}
+
+// Public indices are looked up once per script, a Public outliving its
+// script throws instead of calling into freed memory
+void TestPublicLifetime(ptl::mock::Host &host) {
+  auto spec = MakeSpec();
+
+  spec.publics = {{"OnPing", [](ptl::mock::AmxScript &, cell *params) {
+                     return params[1] + 1;
+                   }}};
+
+  auto &amx_script = host.LoadScript(spec);
+  AMX *amx = amx_script.GetAmx();
+
+  Plugin::DoAmxLoad(amx);
+
+  auto &script = Plugin::GetScript(amx);
+  auto pub = script.MakePublic("OnPing");
+  int lookups = export_calls[PLUGIN_AMX_EXPORT_FindPublic];
+
+  for (cell i = 0; i < 100; ++i) {
+    CHECK(pub->Exec(i) == i + 1);
+  }
+
+  CHECK(script.MakePublic("OnPing")->Exec(1) == 2);
+  CHECK(export_calls[PLUGIN_AMX_EXPORT_FindPublic] == lookups);
+
+  auto missing = script.MakePublic("OnMissing");
+
+  CHECK(!missing->Exists());
+  CHECK(missing->Exec(1) == 0);
+
+  Plugin::DoAmxUnload(amx);
+
+  bool thrown{};
+
+  try {
+    pub->Exec(1);
+  } catch (const std::runtime_error &e) {
+    thrown = std::strstr(e.what(), "already unloaded") != nullptr;
+  }
+
+  CHECK(thrown);
+
+  host.UnloadScript(amx_script);
+}
+
+// Public variables are read and written through the address resolved once,
+// and the handle goes invalid with its script
+void TestPublicVars(ptl::mock::Host &host) {
+  auto spec = MakeSpec();
+
+  spec.pubvars = {{"gCount", 5},
+                  {"gRatio", ptl::FloatToCell(1.5f)},
+                  {"gFlag", 1}};
+
+  auto &amx_script = host.LoadScript(spec);
+  AMX *amx = amx_script.GetAmx();
+
+  Plugin::DoAmxLoad(amx);
+
+  auto &script = Plugin::GetScript(amx);
+  auto count = script.GetPublicVar<int>("gCount");
+
+  CHECK(count.Exists() && count.Get() == 5);
+
+  count.Set(7);
+  CHECK(script.GetPublicVarValue<int>("gCount") == 7);
+
+  CHECK(script.GetPublicVar<float>("gRatio").Get() == 1.5f);
+  CHECK(script.GetPublicVar<bool>("gFlag").Get());
+  CHECK(!script.GetPublicVar("gMissing"));
+  CHECK(script.GetPublicVarValue("gMissing") == 0);
+
+  Plugin::DoAmxUnload(amx);
+
+  CHECK(!count.Exists());
+
+  bool thrown{};
+
+  try {
+    count.Get();
+  } catch (const std::runtime_error &e) {
+    thrown = std::strstr(e.what(), "unloaded script") != nullptr;
+  }
+
+  CHECK(thrown);
+
+  host.UnloadScript(amx_script);
+}
+
+void TestParamValidation(ptl::mock::Host &host) {
+  auto &amx_script = host.LoadScript(MakeSpec());
+
+  Plugin::DoAmxLoad(amx_script.GetAmx());
+
+  cell ref = amx_script.Allot(1);
+
+  CHECK(amx_script.CallNative("Add", 5, 2.5f, ref, "abc", "hello") == 15);
+  CHECK(*amx_script.PhysAddr(ref) == 5);
+
+  // Invalid calls are logged and return 0 without running the native
+  CHECK(amx_script.CallNative("Add", 1) == 0);
+  CHECK(amx_script.CallNative("Add", 5, 2.5f, -8, "abc", "hello") == 0);
+  CHECK(amx_script.CallNative("Add", 5, 2.5f, ref, -8, "hello") == 0);
+  CHECK(amx_script.GetAmx()->error == AMX_ERR_NONE);
+  CHECK(CountLog(host, "Add: Number of parameters must be equal to 5") == 1);
+  CHECK(CountLog(host, "Add: Parameter 3 is an invalid address") == 1);
+  CHECK(CountLog(host, "Add: Parameter 4 is an invalid address") == 1);
+
+  Plugin::DoAmxUnload(amx_script.GetAmx());
+  host.UnloadScript(amx_script);
+}
+
+// Every registered native maps back to its own name
+void TestNativeNames(ptl::mock::Host &host) {
+  auto spec = MakeSpec();
+  auto &amx_script = host.LoadScript(spec);
+
+  Plugin::DoAmxLoad(amx_script.GetAmx());
+
+  for (std::size_t i = 0; i < spec.natives.size(); ++i) {
+    CHECK(Plugin::GetNativeName(amx_script.native_funcs_[i]) ==
+          spec.natives[i]);
+  }
+
+  CHECK(Plugin::GetNativeName(nullptr) == "(unknown native)");
+
+  Plugin::DoAmxUnload(amx_script.GetAmx());
+  host.UnloadScript(amx_script);
+}
+
+// The inline translation accepts exactly the addresses amx_GetAddr accepts,
+// and only calls it for the ones it rejects
+void TestPhysAddr(ptl::mock::Host &host) {
+  auto &amx_script = host.LoadScript(MakeSpec());
+  AMX *amx = amx_script.GetAmx();
+
+  Plugin::DoAmxLoad(amx);
+
+  auto &script = Plugin::GetScript(amx);
+
+  amx_script.Allot(4);  // the heap grows after Init
+
+  std::fill(std::begin(export_calls), std::end(export_calls), 0);
+
+  int invalid{};
+
+  for (cell addr = -8; addr <= amx->stp + 8; addr += sizeof(cell)) {
+    cell *expected{};
+    bool valid =
+        ptl::mock::api::GetAddr(amx, addr, &expected) == AMX_ERR_NONE;
+
+    CHECK(script.IsValidAddr(addr) == valid);
+    CHECK(script.GetPhysAddr(addr) == expected);
+
+    invalid += !valid;
+  }
+
+  CHECK(export_calls[PLUGIN_AMX_EXPORT_GetAddr] == invalid);
+
+  // Ranges may not span the gap between the heap and the stack
+  CHECK(script.IsValidRange(0, 4));
+  CHECK(!script.IsValidRange(amx->hea - sizeof(cell), 2));
+  CHECK(!script.IsValidRange(0, -1));
+
+  Plugin::DoAmxUnload(amx);
+  host.UnloadScript(amx_script);
+}
+
+void TestSpan(ptl::mock::Host &host) {
+  auto &amx_script = host.LoadScript(MakeSpec());
+
+  Plugin::DoAmxLoad(amx_script.GetAmx());
+
+  cell *arr{};
+  cell arr_addr = amx_script.Allot(4, &arr);
+
+  for (cell i = 0; i < 4; ++i) {
+    arr[i] = i + 1;
+  }
+
+  CHECK(amx_script.CallNative("Sum", arr_addr, 4) == 10);
+  CHECK(amx_script.CallNative("Sum", arr_addr, 0) == 0);
+
+  // The whole range is checked, not only its first cell
+  CHECK(amx_script.CallNative("Sum", arr_addr, 1 << 20) == 0);
+  CHECK(amx_script.CallNative("Sum", arr_addr, -1) == 0);
+
+  Plugin::DoAmxUnload(amx_script.GetAmx());
+  host.UnloadScript(amx_script);
+}
+
+void TestOutString(ptl::mock::Host &host) {
+  auto &amx_script = host.LoadScript(MakeSpec());
+
+  Plugin::DoAmxLoad(amx_script.GetAmx());
+
+  auto &script = Plugin::GetScript(amx_script.GetAmx());
+  cell *out{};
+  cell out_addr = amx_script.Allot(8, &out);
+
+  // Truncated to the buffer and always terminated
+  CHECK(amx_script.CallNative("Format", out_addr, 8, 42) == 7);
+  CHECK(script.GetString(out_addr) == "value=4");
+
+  CHECK(amx_script.CallNative("Format", out_addr, 3, 42) == 2);
+  CHECK(script.GetString(out_addr) == "va");
+
+  // Packed output goes through the same truncation
+  ptl::OutString packed{out, 2};
+
+  packed.SetPacked(true).Printf("%s", "packed text");
+  CHECK(packed.Length() == 7);
+  CHECK(script.GetString(out_addr) == "packed ");
+
+  ptl::OutString streamed{out, 8};
+  const char *null_str{};
+
+  streamed << "a" << null_str << 'b' << 12;
+  CHECK(streamed.Length() == 4);
+  CHECK(script.GetString(out_addr) == "ab12");
+
+  Plugin::DoAmxUnload(amx_script.GetAmx());
+  host.UnloadScript(amx_script);
+}
+
+void TestStringBuffer(ptl::mock::Host &host) {
+  auto &amx_script = host.LoadScript(MakeSpec());
+
+  Plugin::DoAmxLoad(amx_script.GetAmx());
+
+  auto &script = Plugin::GetScript(amx_script.GetAmx());
+  std::string long_str(ptl::AmxStringBuffer::inline_capacity + 40, 'x');
+
+  // Short strings stay in the inline buffer, longer ones move to the heap
+  auto short_buffer = script.GetStringBuffer(amx_script.AllotString("short"));
+
+  CHECK(short_buffer.View() == "short");
+  CHECK(reinterpret_cast<const char *>(short_buffer.Data()) >=
+            reinterpret_cast<const char *>(&short_buffer) &&
+        reinterpret_cast<const char *>(short_buffer.Data()) <
+            reinterpret_cast<const char *>(&short_buffer + 1));
+
+  auto long_buffer =
+      script.GetStringBuffer(amx_script.AllotString(long_str.c_str()));
+
+  CHECK(long_buffer.View() == long_str);
+  CHECK(long_buffer.Data()[long_buffer.Size()] == '\0');
+
+  auto packed_buffer =
+      script.GetStringBuffer(amx_script.AllotString(long_str.c_str(), true));
+
+  CHECK(packed_buffer.Str() == long_str);
+
+  ptl::AmxStringBuffer empty{nullptr};
+
+  CHECK(empty.Empty() && empty.Data()[0] == '\0');
+
+  CHECK(amx_script.CallNative("StrSize", "") == 0);
+  CHECK(amx_script.CallNative("StrSize", "text") == 4);
+  CHECK(amx_script.CallNative("StrSize", long_str.c_str()) ==
+        static_cast<cell>(long_str.size()));
+
+  Plugin::DoAmxUnload(amx_script.GetAmx());
+  host.UnloadScript(amx_script);
+}
+
+// Whatever kernels were selected must match a plain per-character loop, for
+// every length and alignment the vector loops and their tails can see
+void TestStringKernels() {
+  std::vector<cell> buffer(256 + 16);
+
+  for (std::size_t offset = 0; offset < 8; ++offset) {
+    for (std::size_t len = 0; len < 200; ++len) {
+      cell *str = buffer.data() + offset;
+      std::string expected;
+
+      for (std::size_t i = 0; i < len; ++i) {
+        expected += static_cast<char>(1 + (i * 37 + offset) % 255);
+        str[i] = static_cast<unsigned char>(expected[i]);
+      }
+
+      str[len] = 0;
+
+      CHECK(ptl::StringKernels::Length(str) == len);
+
+      std::string narrowed(len, '\0');
+
+      ptl::StringKernels::Narrow(narrowed.data(), str, len);
+      CHECK(narrowed == expected);
+
+      std::vector<cell> widened(len + 1, -1);
+
+      ptl::StringKernels::Widen(widened.data(), expected.data(), len);
+      CHECK(std::equal(widened.begin(), widened.begin() + len, str));
+      CHECK(widened[len] == -1);
+
+      // Packed: the first character is in the most significant byte
+      std::fill(buffer.begin(), buffer.end(), 0);
+
+      auto bytes = reinterpret_cast<ucell *>(str);
+
+      for (std::size_t i = 0; i < len; ++i) {
+        bytes[i / 4] |= static_cast<ucell>(
+                            static_cast<unsigned char>(expected[i]))
+                        << (24 - 8 * (i % 4));
+      }
+
+      if (len) {
+        CHECK(ptl::StringKernels::IsPacked(str));
+        CHECK(ptl::StringKernels::Length(str) == len);
+
+        ptl::StringKernels::Narrow(narrowed.data(), str, len);
+        CHECK(narrowed == expected);
+      }
+    }
+  }
+}
+
+// Completions cross the lock-free queue from the workers to the server thread
+void TestTaskPool() {
+  constexpr int tasks = 1000;
+  int completed{};
+
+  for (int i = 0; i < tasks; ++i) {
+    Plugin::Tasks().Submit([&completed, i]() -> ptl::TaskPool::Completion {
+      int value = i * 2;
+
+      return [&completed, i, value] {
+        CHECK(value == i * 2);
+        ++completed;
+      };
+    });
+  }
+
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds{10};
+
+  while (completed < tasks && std::chrono::steady_clock::now() < deadline) {
+    Plugin::DoProcessTick();
+    std::this_thread::yield();
+  }
+
+  CHECK(completed == tasks);
+}
+
+// What AssertFormat sees for Log(PTL_FMT(fmt), Args...)
+template <typename... Args>
+constexpr ptl::FormatError CheckFormat(const char *fmt) {
+  constexpr ptl::FormatArgInfo args[] = {
+      ptl::GetFormatArgInfo<Args>()..., {ptl::FormatArgInfo::Kind::kNone, 0}};
+
+  return ptl::CheckFormat(fmt, args, sizeof...(Args));
+}
+
+using ptl::FormatError;
+
+static_assert(CheckFormat<int, std::string, double>("%d %s %.2f") ==
+              FormatError::kNone);
+static_assert(CheckFormat<>("100%%") == FormatError::kNone);
+static_assert(CheckFormat<long long, std::size_t>("%lld %zu") ==
+              FormatError::kNone);
+static_assert(CheckFormat<int, int>("%*d") == FormatError::kNone);
+static_assert(CheckFormat<const char *>("%d") == FormatError::kTypeMismatch);
+static_assert(CheckFormat<int>("%lld") == FormatError::kTypeMismatch);
+static_assert(CheckFormat<float>("%s") == FormatError::kTypeMismatch);
+static_assert(CheckFormat<int>("%d %d") == FormatError::kTooFewArgs);
+static_assert(CheckFormat<int, int>("%d") == FormatError::kTooManyArgs);
+static_assert(CheckFormat<int *>("%n") == FormatError::kBadSpecifier);
+static_assert(CheckFormat<int>("%") == FormatError::kBadSpecifier);
+
+// Checked messages are formatted once, std::string goes in as %s
+void TestFormatLog(ptl::mock::Host &host) {
+  Plugin::Log(PTL_FMT("checked %s %d %.1f %c"), std::string{"str"}, 5, 1.5,
+              'x');
+  CHECK(CountLog(host, "[ptl_test] checked str 5 1.5 x") == 1);
+}
+
+// Messages wait in the ring until Flush, the overflow is counted and long
+// messages are cut at the slot size
+void TestAsyncLogger(ptl::mock::Host &host) {
+  ptl::Logger logger;
+  constexpr int threads = 4;
+  constexpr int per_thread = 100;
+
+  logger.SetLogPrintf(reinterpret_cast<ptl::LogPrintf>(
+      host.PluginData()[PLUGIN_DATA_LOGPRINTF]));
+  logger.SetName("async");
+  logger.SetAsync(true);
+
+  for (std::size_t i = 0; i < ptl::Logger::ring_size + 5; ++i) {
+    logger.Log("overflow %d", static_cast<int>(i));
+  }
+
+  CHECK(CountLog(host, "[async] overflow") == 0);
+
+  logger.Flush();
+  CHECK(CountLog(host, "[async] overflow") == ptl::Logger::ring_size);
+  CHECK(CountLog(host, "[async] 5 log message(s) dropped") == 1);
+
+  std::vector<std::thread> writers;
+
+  for (int t = 0; t < threads; ++t) {
+    writers.emplace_back([&logger] {
+      for (int i = 0; i < per_thread; ++i) {
+        logger.Log("concurrent %d", i);
+      }
+    });
+  }
+
+  for (auto &writer : writers) {
+    writer.join();
+  }
+
+  logger.Flush();
+  CHECK(CountLog(host, "[async] concurrent") == threads * per_thread);
+
+  std::string long_text(2 * ptl::Logger::message_size, 'x');
+
+  logger.Log("long %s", long_text.c_str());
+  logger.Flush();
+
+  const auto &last = host.Log().back();
+  std::string marker{ptl::Logger::truncated_marker};
+
+  CHECK(last.size() == ptl::Logger::message_size - 1);
+  CHECK(last.size() >= marker.size() &&
+        last.compare(last.size() - marker.size(), marker.size(), marker) == 0);
+
+  // Synchronous messages are never cut
+  logger.SetAsync(false);
+  logger.Log("sync %s", long_text.c_str() + ptl::Logger::message_size / 2);
+  CHECK(host.Log().back().size() > ptl::Logger::message_size);
+}
+
+// Anything thrown by work or a completion is logged by the tick
+void TestTaskErrors(ptl::mock::Host &host) {
+  Plugin::Tasks().Submit([]() -> ptl::TaskPool::Completion { throw 1; });
+  Plugin::Tasks().Submit([]() -> ptl::TaskPool::Completion {
+    return [] { throw std::runtime_error{"completion failed"}; };
+  });
+  Plugin::Tasks().Submit([]() -> ptl::TaskPool::Completion {
+    return [] { throw 2; };
+  });
+
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds{10};
+
+  while (CountLog(host, "task: ") < 3 &&
+         std::chrono::steady_clock::now() < deadline) {
+    Plugin::DoProcessTick();
+    std::this_thread::yield();
+  }
+
+  CHECK(CountLog(host, "task: unknown exception") == 2);
+  CHECK(CountLog(host, "task: completion failed") == 1);
+}
+
+// The arena is rewound after every native and tick, it never grows with them
+void TestScratchScopes(ptl::mock::Host &host) {
+  auto &amx_script = host.LoadScript(MakeSpec());
+
+  Plugin::DoAmxLoad(amx_script.GetAmx());
+
+  auto &arena = Plugin::GetScript(amx_script.GetAmx()).Scratch();
+  auto before = arena.GetMark();
+  cell ref_addr = amx_script.Allot(1);
+
+  // Both strings, and the std::string_view one in the arena
+  CHECK(amx_script.CallNative("Add", 1, 2.0f, ref_addr, "three", "four") ==
+        1 + 2 + 5 + 4);
+
+  auto after = arena.GetMark();
+
+  CHECK(after.chunk == before.chunk && after.offset == before.offset);
+
+  Plugin::tick_scratch_bytes = 1024;
+
+  for (int i = 0; i < 200; ++i) {
+    Plugin::DoProcessTick();
+  }
+
+  Plugin::tick_scratch_bytes = 0;
+
+  after = arena.GetMark();
+
+  CHECK(after.chunk == before.chunk && after.offset == before.offset);
+  CHECK(arena.Capacity() <= ptl::ScratchArena::chunk_size);
+
+  Plugin::DoAmxUnload(amx_script.GetAmx());
+  host.UnloadScript(amx_script);
+}
+
+// Natives nobody registered, whichever plugin they belong to
+void TestUnresolvedNatives(ptl::mock::Host &host) {
+  auto spec = MakeSpec();
+
+  spec.natives.push_back("OtherPluginNative");
+
+  auto &amx_script = host.LoadScript(spec);
+
+  Plugin::DoAmxLoad(amx_script.GetAmx());
+
+  auto unresolved =
+      Plugin::GetScript(amx_script.GetAmx()).GetUnresolvedNatives();
+
+  CHECK(unresolved.size() == 1);
+  CHECK(!unresolved.empty() && unresolved[0] == "OtherPluginNative");
+  CHECK(CountLog(host, "script has 1 native(s) not registered by this or an "
+                       "earlier plugin: OtherPluginNative") == 1);
+
+  Plugin::DoAmxUnload(amx_script.GetAmx());
+  host.UnloadScript(amx_script);
+
+  // Fully resolved scripts are not reported
+  CHECK(CountLog(host, "not registered by this or an earlier plugin") == 1);
+}
+
+// Arguments are only formatted for the log line of a failed call
+void TestPublicErrorArgs(ptl::mock::Host &host) {
+  auto spec = MakeSpec();
+
+  spec.publics = {{"OnMaybeFail", [](ptl::mock::AmxScript &self,
+                                     cell *params) {
+                     if (params[2]) {
+                       self.GetAmx()->error = AMX_ERR_BOUNDS;
+                     }
+
+                     return 0;
+                   }}};
+
+  auto &amx_script = host.LoadScript(spec);
+
+  Plugin::DoAmxLoad(amx_script.GetAmx());
+
+  auto pub = Plugin::GetScript(amx_script.GetAmx()).MakePublic("OnMaybeFail");
+
+  pub->Exec("text", 0);
+  CHECK(CountLog(host, "in public OnMaybeFail(") == 0);
+
+  pub->Exec("text", 7);
+  CHECK(CountLog(host, "in public OnMaybeFail(\"text\", 7)") == 1);
+
+  Plugin::DoAmxUnload(amx_script.GetAmx());
+  host.UnloadScript(amx_script);
+}
+
+// Built with and without PTL_ENABLE_STATS, see CMakeLists.txt
+void TestStats(ptl::mock::Host &host) {
+  auto spec = MakeSpec();
+
+  spec.publics = {{"OnStats", [](ptl::mock::AmxScript &, cell *) {
+                     return 1;
+                   }}};
+
+  auto &amx_script = host.LoadScript(spec);
+
+  Plugin::DoAmxLoad(amx_script.GetAmx());
+
+  Plugin::ResetStats();
+
+  cell ref = amx_script.Allot(1);
+  auto pub = Plugin::GetScript(amx_script.GetAmx()).MakePublic("OnStats");
+
+  for (int i = 0; i < 3; ++i) {
+    amx_script.CallNative("Add", 1, 2.0f, ref, "a", "b");
+    pub->Exec();
+  }
+
+  amx_script.CallNative("Add", 1);
+
+  // Entries point to the live counters
+  auto entries = ptl::Stats::Snapshot();
+
+  if constexpr (ptl::Stats::enabled) {
+    auto find = [&entries](const char *name) -> const ptl::CallStats * {
+      for (auto entry : entries) {
+        if (entry->name == name) {
+          return entry;
+        }
+      }
+
+      return nullptr;
+    };
+
+    auto add = find("Add");
+    auto on_stats = find("OnStats");
+
+    CHECK(entries.size() == 2);
+    CHECK(add && !add->is_public && add->calls == 4 && add->errors == 1 &&
+          add->max_ns <= add->total_ns);
+    CHECK(on_stats && on_stats->is_public && on_stats->calls == 3 &&
+          on_stats->errors == 0);
+  } else {
+    CHECK(entries.empty());
+  }
+
+  CHECK(amx_script.CallNative("PTL_DumpStats", 1) == 1);
+
+  if constexpr (ptl::Stats::enabled) {
+    CHECK(CountLog(host, "native Add: calls=4 errors=1") == 1);
+    CHECK(CountLog(host, "public OnStats: calls=3 errors=0") == 1);
+
+    // Reset by the dump, only the dump itself is counted since
+    entries = ptl::Stats::Snapshot();
+    CHECK(entries.size() == 1 && entries[0]->name == "PTL_DumpStats");
+  } else {
+    CHECK(CountLog(host, "stats are disabled") == 1);
+  }
+
+  Plugin::DoAmxUnload(amx_script.GetAmx());
+  host.UnloadScript(amx_script);
+}
+
+void TestErrorRateLimit(ptl::mock::Host &host) {
+  auto spec = MakeSpec();
+
+  spec.publics = {{"OnBad", [](ptl::mock::AmxScript &self, cell *) {
+                     self.GetAmx()->error = AMX_ERR_BOUNDS;
+
+                     return 0;
+                   }}};
+
+  auto &amx_script = host.LoadScript(spec);
+
+  Plugin::DoAmxLoad(amx_script.GetAmx());
+
+  auto pub = Plugin::GetScript(amx_script.GetAmx()).MakePublic("OnBad");
+
+  for (int i = 0; i < 100; ++i) {
+    pub->Exec();
+  }
+
+  CHECK(CountLog(host, "in public OnBad()") == 3);
+
+  // The rest is reported by the next tick a second later
+  std::this_thread::sleep_for(std::chrono::milliseconds(1100));
+  Plugin::DoProcessTick();
+  CHECK(CountLog(host, "public OnBad: 97 repeat(s) suppressed") == 1);
+
+  Plugin::DoAmxUnload(amx_script.GetAmx());
+  host.UnloadScript(amx_script);
+}
+
+void TestHandles(ptl::mock::Host &host) {
+  auto &table = ptl::HandleTable<Timer>::Instance();
+  auto &first = host.LoadScript(MakeSpec());
+  auto &second = host.LoadScript(MakeSpec());
+
+  Plugin::DoAmxLoad(first.GetAmx());
+  Plugin::DoAmxLoad(second.GetAmx());
+
+  cell a = first.CallNative("CreateTimer", 100);
+  cell b = second.CallNative("CreateTimer", 200);
+
+  CHECK(a > 0 && b > 0 && a != b);
+  CHECK(second.CallNative("TimerInterval", a) == 100);
+  CHECK(first.CallNative("TimerInterval", 0) == 0);
+
+  // A released handle stays invalid after its slot is reused
+  CHECK(table.Release(a));
+  CHECK(!table.Release(a));
+
+  cell c = first.CallNative("CreateTimer", 300);
+
+  CHECK(c != a && !table.Contains(a));
+  CHECK(first.CallNative("TimerInterval", a) == 0);
+  CHECK(first.CallNative("TimerInterval", c) == 300);
+  CHECK(table.GetOwner(c) == first.GetAmx());
+
+  cell d = second.CallNative("CreateTimer", 400);
+
+  CHECK(first.CallNative("DestroyTimer", d) == 1);
+  CHECK(first.CallNative("DestroyTimer", d) == 0);
+  CHECK(!table.Contains(d));
+
+  for (int i = 0; i < 5000; ++i) {
+    cell handle = table.Emplace(nullptr, i);
+
+    CHECK(handle > 0 && table.Get(handle)->interval == i);
+    table.Release(handle);
+    CHECK(!table.Contains(handle));
+  }
+
+  // Objects owned by a script go away with it
+  Plugin::DoAmxUnload(second.GetAmx());
+  host.UnloadScript(second);
+  CHECK(!table.Contains(b) && table.Contains(c) && Timer::alive == 1);
+
+  Plugin::DoAmxUnload(first.GetAmx());
+  host.UnloadScript(first);
+  CHECK(table.Empty() && Timer::alive == 0);
+}
+
+void TestReferenceParams(ptl::mock::Host &host) {
+  auto &amx_script = host.LoadScript(MakeSpec());
+
+  Plugin::DoAmxLoad(amx_script.GetAmx());
+
+  cell *arr{};
+  cell arr_addr = amx_script.Allot(4, &arr);
+
+  for (cell i = 0; i < 4; ++i) {
+    arr[i] = i + 1;
+  }
+
+  CHECK(amx_script.CallNative("SumRef", arr_addr, 4) == 10);
+  CHECK(amx_script.CallNative("FormatRef", arr_addr, 4, 7) == 3);
+  CHECK(Plugin::GetScript(amx_script.GetAmx()).GetString(arr_addr) == "val");
+  CHECK(CountLog(host, "Ref: Parameter 1 is an invalid handle") == 0);
+
+  // The array checks still apply
+  CHECK(amx_script.CallNative("SumRef", arr_addr, 1 << 20) == 0);
+  CHECK(CountLog(host, "SumRef: Parameters 1-2 are an invalid array") == 1);
+
+  Plugin::DoAmxUnload(amx_script.GetAmx());
+  host.UnloadScript(amx_script);
+}
+
+// Start returns at once, the TSC is calibrated by a later tick
+void TestTickProfiler() {
+  ptl::TickProfiler profiler;
+  auto started = std::chrono::steady_clock::now();
+
+  profiler.Start(1000, 1);
+
+  CHECK(std::chrono::steady_clock::now() - started <
+        std::chrono::milliseconds{1});
+
+  std::this_thread::sleep_for(std::chrono::milliseconds{20});
+
+  std::uint64_t start = ptl::TickProfiler::Now();
+
+  profiler.Record(start, start);
+
+  // 3ms against a 1ms budget
+  start = ptl::TickProfiler::Now();
+  std::this_thread::sleep_for(std::chrono::milliseconds{3});
+
+  bool report = profiler.Record(start, ptl::TickProfiler::Now());
+
+  CHECK(profiler.Microseconds(ptl::TickProfiler::Now() - start) >= 3000);
+
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds{5};
+
+  while (!report && std::chrono::steady_clock::now() < deadline) {
+    std::this_thread::sleep_for(std::chrono::milliseconds{10});
+
+    std::uint64_t now = ptl::TickProfiler::Now();
+
+    report = profiler.Record(now, now);
+  }
+
+  std::vector<std::string> lines;
+
+  profiler.Report(ptl::TickProfiler::Now(),
+                  [&lines](const char *fmt, auto... args) {
+                    char line[256];
+
+                    std::snprintf(line, sizeof(line), fmt, args...);
+                    lines.push_back(line);
+                  });
+
+  CHECK(report && lines.size() == 2);
+  CHECK(!lines.empty() &&
+        lines[0].find("1 tick(s) over the 1000us budget") == 0);
+  CHECK(lines.size() > 1 && lines[1].find("ticks: ") == 0);
+}
+
+// The hooked exports are called unless the plugin opts in to inline calls,
+// and both paths give the same results
+template <typename PluginT>
+void CheckAmxCalls(ptl::mock::AmxScript &amx_script, bool inlined) {
+  auto &script = PluginT::GetScript(amx_script.GetAmx());
+  ptl::Amx &amx = *script.GetAmx();
+  cell str = amx_script.AllotString("text");
+  cell hea = amx_script.GetAmx()->hea;
+  cell *phys_addr{};
+  int len{};
+
+  std::fill(std::begin(export_calls), std::end(export_calls), 0);
+
+  CHECK(amx.GetAddr(str, &phys_addr) == AMX_ERR_NONE &&
+        phys_addr == amx_script.PhysAddr(str));
+  CHECK(amx.GetAddr<false>(-8, &phys_addr) == AMX_ERR_MEMACCESS &&
+        !phys_addr);
+  CHECK(amx.StrLen(amx_script.PhysAddr(str), &len) == AMX_ERR_NONE &&
+        len == 4);
+  CHECK(script.MakePublic("OnArgs")->Exec("abc", 1) == 2 * sizeof(cell));
+  CHECK(amx_script.GetAmx()->hea == hea);
+
+  int expected = inlined ? 0 : 1;
+
+  CHECK(export_calls[PLUGIN_AMX_EXPORT_GetAddr] == 2 * expected);
+  CHECK(export_calls[PLUGIN_AMX_EXPORT_StrLen] == expected);
+  CHECK(export_calls[PLUGIN_AMX_EXPORT_Push] == 2 * expected);
+  CHECK(export_calls[PLUGIN_AMX_EXPORT_Release] == expected);
+}
+
+void TestInlineAmxCalls(ptl::mock::Host &host) {
+  auto spec = MakeSpec();
+
+  spec.publics = {{"OnArgs", [](ptl::mock::AmxScript &, cell *params) {
+                     return params[0];
+                   }}};
+
+  auto &amx_script = host.LoadScript(spec);
+
+  Plugin::DoAmxLoad(amx_script.GetAmx());
+  InlinePlugin::DoAmxLoad(amx_script.GetAmx());
+
+  CheckAmxCalls<Plugin>(amx_script, false);
+  CheckAmxCalls<InlinePlugin>(amx_script, true);
+
+  InlinePlugin::DoAmxUnload(amx_script.GetAmx());
+  Plugin::DoAmxUnload(amx_script.GetAmx());
+  host.UnloadScript(amx_script);
+}
+}  // namespace
+
+int main() {
+  ptl::mock::Host host;
+
+  HookExports(host);
+
+  Plugin::DoLoad(host.PluginData());
+  InlinePlugin::DoLoad(host.PluginData());
+
+  TestBroadcastRefresh(host);
+  TestPublicStrings(host);
+  TestScriptLookup(host);
+  TestPublicLifetime(host);
+  TestPublicVars(host);
+  TestParamValidation(host);
+  TestNativeNames(host);
+  TestPhysAddr(host);
+  TestSpan(host);
+  TestOutString(host);
+  TestStringBuffer(host);
+  TestStringKernels();
+  TestTaskPool();
+  TestTaskErrors(host);
+  TestFormatLog(host);
+  TestAsyncLogger(host);
+  TestScratchScopes(host);
+  TestUnresolvedNatives(host);
+  TestPublicErrorArgs(host);
+  TestStats(host);
+  TestErrorRateLimit(host);
+  TestHandles(host);
+  TestReferenceParams(host);
+  TestInlineAmxCalls(host);
+  TestTickProfiler();
+
+  InlinePlugin::DoUnload();
+  Plugin::DoUnload();
+
+  if (failures) {
+    for (const auto &line : host.Log()) {
+      std::printf("log: %s\n", line.c_str());
+    }
+
+    std::printf("%d check(s) failed\n", failures);
+
+    return 1;
+  }
+
+  std::printf("all checks passed (%s kernels)\n", ptl::StringKernels::Isa());
+
+  return 0;
+}
@@ -0,0 +1,1011 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2020-2023 katursis
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef PTL_MOCK_AMX_HOST_H_
+#define PTL_MOCK_AMX_HOST_H_
+
+#include <algorithm>
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+#include "../amx/amx.h"
+#include "../plugincommon.h"
+
+// In-process stand-in for the SA:MP server: implements the PLUGIN_AMX_EXPORT
+// function table over synthetic AMX instances with a real header, data, heap
+// and stack layout. There is no bytecode: publics are C++ handlers.
+//
+//   ptl::mock::Host host;
+//   Plugin::DoLoad(host.PluginData());
+//
+//   ptl::mock::AmxScriptSpec spec;
+//   spec.natives = {"MyNative"};
+//   spec.publics = {{"OnSomething", [](auto &script, cell *params) {
+//     return params[1];  // params[0] is the size of the arguments
+//   }}};
+//
+//   auto &script = host.LoadScript(spec);
+//   Plugin::DoAmxLoad(script.GetAmx());
+//   script.CallNative("MyNative", 1, 2.0f, "three");
+//   Plugin::DoProcessTick();
+//   Plugin::DoAmxUnload(script.GetAmx());
+//   host.UnloadScript(script);
+//   Plugin::DoUnload();
+namespace ptl::mock {
+class AmxScript;
+
+using PublicHandler = std::function<cell(AmxScript &script, cell *params)>;
+
+struct AmxScriptSpec {
+  struct PublicVar {
+    std::string name;
+    cell value{};
+  };
+
+  std::vector<std::pair<std::string, PublicHandler>> publics;
+  std::vector<std::string> natives;
+  std::vector<PublicVar> pubvars;
+  std::size_t data_cells{64};    // globals, public variables come first
+  std::size_t stack_cells{4096};  // stack + heap
+};
+
+class AmxScript {
+ public:
+  explicit AmxScript(const AmxScriptSpec &spec) {
+    std::vector<std::string> publics;
+
+    for (auto &[name, handler] : spec.publics) {
+      publics.push_back(name);
+    }
+
+    // amx_FindPublic and amx_FindPubVar do a binary search, so publics and
+    // public variables are sorted by name
+    std::sort(publics.begin(), publics.end());
+
+    for (auto &name : publics) {
+      auto handler = std::find_if(
+          spec.publics.begin(), spec.publics.end(),
+          [&name](const auto &public_) { return public_.first == name; });
+
+      handlers_.push_back(handler->second);
+    }
+
+    if (spec.pubvars.size() > spec.data_cells) {
+      throw std::runtime_error{"data_cells is too small for the pubvars"};
+    }
+
+    const std::size_t stub_size = sizeof(AMX_FUNCSTUBNT);
+    const std::size_t num_entries =
+        publics.size() + spec.natives.size() + spec.pubvars.size();
+
+    std::size_t names_size = sizeof(uint16_t);
+    std::size_t max_name_length{};
+
+    auto count_names = [&](const std::vector<std::string> &names) {
+      for (auto &name : names) {
+        names_size += name.size() + 1;
+        max_name_length = std::max(max_name_length, name.size());
+      }
+    };
+
+    std::vector<std::string> pubvars;
+    std::vector<std::size_t> pubvar_cells;  // by name, index into the data
+
+    for (std::size_t i = 0; i < spec.pubvars.size(); ++i) {
+      pubvar_cells.push_back(i);
+    }
+
+    std::sort(pubvar_cells.begin(), pubvar_cells.end(),
+              [&spec](std::size_t a, std::size_t b) {
+                return spec.pubvars[a].name < spec.pubvars[b].name;
+              });
+
+    for (auto i : pubvar_cells) {
+      pubvars.push_back(spec.pubvars[i].name);
+    }
+
+    count_names(publics);
+    count_names(spec.natives);
+    count_names(pubvars);
+
+    const std::size_t tables = sizeof(AMX_HEADER);
+    const std::size_t nametable = tables + num_entries * stub_size;
+    const std::size_t dat =
+        (nametable + names_size + sizeof(cell) - 1) / sizeof(cell) *
+        sizeof(cell);
+    const std::size_t hea = dat + spec.data_cells * sizeof(cell);
+    const std::size_t stp = hea + spec.stack_cells * sizeof(cell);
+
+    memory_.reset(new unsigned char[stp]{});
+
+    auto hdr = reinterpret_cast<AMX_HEADER *>(memory_.get());
+
+    hdr->size = static_cast<int32_t>(dat);
+    hdr->magic = AMX_MAGIC;
+    hdr->file_version = CUR_FILE_VERSION;
+    hdr->amx_version = MIN_AMX_VERSION;
+    hdr->defsize = static_cast<int16_t>(stub_size);
+    hdr->cod = static_cast<int32_t>(dat);
+    hdr->dat = static_cast<int32_t>(dat);
+    hdr->hea = static_cast<int32_t>(hea);
+    hdr->stp = static_cast<int32_t>(stp);
+    hdr->publics = static_cast<int32_t>(tables);
+    hdr->natives =
+        static_cast<int32_t>(hdr->publics + publics.size() * stub_size);
+    hdr->libraries =
+        static_cast<int32_t>(hdr->natives + spec.natives.size() * stub_size);
+    hdr->pubvars = hdr->libraries;
+    hdr->tags =
+        static_cast<int32_t>(hdr->pubvars + spec.pubvars.size() * stub_size);
+    hdr->nametable = static_cast<int32_t>(nametable);
+
+    *reinterpret_cast<uint16_t *>(memory_.get() + nametable) =
+        static_cast<uint16_t>(max_name_length);
+
+    std::size_t name_offset = nametable + sizeof(uint16_t);
+
+    auto fill = [&](int32_t table, const std::vector<std::string> &names,
+                    auto address) {
+      auto stub = reinterpret_cast<AMX_FUNCSTUBNT *>(memory_.get() + table);
+
+      for (std::size_t i = 0; i < names.size(); ++i, ++stub) {
+        stub->address = address(i);
+        stub->nameofs = static_cast<uint32_t>(name_offset);
+
+        std::memcpy(memory_.get() + name_offset, names[i].c_str(),
+                    names[i].size() + 1);
+
+        name_offset += names[i].size() + 1;
+      }
+    };
+
+    // Public addresses are indices into handlers_, native addresses are
+    // indices + 1 into native_funcs_ (0 means unresolved)
+    fill(hdr->publics, publics, [](std::size_t i) { return i; });
+    fill(hdr->natives, spec.natives, [](std::size_t) { return 0; });
+    fill(hdr->pubvars, pubvars,
+         [&](std::size_t i) { return pubvar_cells[i] * sizeof(cell); });
+
+    native_funcs_.resize(spec.natives.size());
+
+    amx_.base = memory_.get();
+
+    for (std::size_t i = 0; i < spec.pubvars.size(); ++i) {
+      Data()[i] = spec.pubvars[i].value;
+    }
+
+    amx_.hlw = amx_.hea = static_cast<cell>(hea - dat);
+    amx_.stp = amx_.stk = static_cast<cell>(stp - dat - sizeof(cell));
+    amx_.flags = AMX_FLAG_NTVREG | AMX_FLAG_RELOC;
+  }
+
+  AmxScript(const AmxScript &) = delete;
+  AmxScript &operator=(const AmxScript &) = delete;
+
+  inline AMX *GetAmx() { return &amx_; }
+
+  inline AMX_HEADER *GetHeader() {
+    return reinterpret_cast<AMX_HEADER *>(amx_.base);
+  }
+
+  inline cell *Data() {
+    return reinterpret_cast<cell *>(amx_.data ? amx_.data
+                                              : amx_.base + GetHeader()->dat);
+  }
+
+  static AmxScript &FromAmx(AMX *amx) {
+    auto script = Registry().find(amx);
+
+    if (script == Registry().end()) {
+      throw std::runtime_error{"AMX does not belong to the mock host"};
+    }
+
+    return *script->second;
+  }
+
+  static std::unordered_map<AMX *, AmxScript *> &Registry() {
+    static std::unordered_map<AMX *, AmxScript *> registry;
+
+    return registry;
+  }
+
+  inline AMX_FUNCSTUBNT *Stub(int32_t table, int index) {
+    return reinterpret_cast<AMX_FUNCSTUBNT *>(amx_.base + table) + index;
+  }
+
+  inline int NumEntries(int32_t table, int32_t next_table) {
+    return (next_table - table) / GetHeader()->defsize;
+  }
+
+  inline const char *EntryName(const AMX_FUNCSTUBNT *stub) {
+    return reinterpret_cast<const char *>(amx_.base + stub->nameofs);
+  }
+
+  // Calls the native the way a SYSREQ opcode would: arguments are pushed on
+  // the AMX stack and the native gets a pointer to the parameter count
+  template <typename... Args>
+  cell CallNative(const char *name, Args... args) {
+    auto hdr = GetHeader();
+    int index{};
+
+    for (; index < NumEntries(hdr->natives, hdr->libraries); ++index) {
+      if (!std::strcmp(EntryName(Stub(hdr->natives, index)), name)) {
+        break;
+      }
+    }
+
+    if (index == NumEntries(hdr->natives, hdr->libraries) ||
+        !Stub(hdr->natives, index)->address) {
+      amx_.error = AMX_ERR_NOTFOUND;
+
+      return 0;
+    }
+
+    cell hea = amx_.hea;
+    cell stk = amx_.stk;
+
+    PushArgs(args...);
+
+    Push(static_cast<cell>(sizeof...(Args) * sizeof(cell)));
+
+    cell result = native_funcs_[Stub(hdr->natives, index)->address - 1](
+        &amx_, Data() + amx_.stk / sizeof(cell));
+
+    amx_.stk = stk;
+    amx_.hea = hea;
+
+    return result;
+  }
+
+  // Allots an array on the heap, returns its AMX address
+  cell Allot(std::size_t cells, cell **phys_addr = nullptr) {
+    if (amx_.stk - amx_.hea - static_cast<cell>(cells * sizeof(cell)) <
+        static_cast<cell>(16 * sizeof(cell))) {
+      throw std::runtime_error{"AMX heap is full"};
+    }
+
+    cell amx_addr = amx_.hea;
+
+    amx_.hea += static_cast<cell>(cells * sizeof(cell));
+
+    if (phys_addr) {
+      *phys_addr = Data() + amx_addr / sizeof(cell);
+    }
+
+    return amx_addr;
+  }
+
+  cell AllotString(const char *str, bool pack = false) {
+    std::size_t len = std::strlen(str);
+    std::size_t cells = pack ? len / sizeof(cell) + 1 : len + 1;
+    cell *phys_addr{};
+    cell amx_addr = Allot(cells, &phys_addr);
+
+    SetString(phys_addr, str, pack, cells);
+
+    return amx_addr;
+  }
+
+  inline cell *PhysAddr(cell amx_addr) {
+    return Data() + amx_addr / sizeof(cell);
+  }
+
+  inline void Push(cell value) {
+    amx_.stk -= sizeof(cell);
+
+    *PhysAddr(amx_.stk) = value;
+  }
+
+  static void SetString(cell *dest, const char *source, bool pack,
+                        std::size_t size) {
+    std::size_t len = std::strlen(source);
+
+    if (pack) {
+      if (len > size * sizeof(cell) - 1) {
+        len = size * sizeof(cell) - 1;
+      }
+
+      std::memset(dest, 0, (len / sizeof(cell) + 1) * sizeof(cell));
+
+      for (std::size_t i = 0; i < len; ++i) {
+        int shift = static_cast<int>((sizeof(cell) - 1 - i % sizeof(cell)) * 8);
+
+        dest[i / sizeof(cell)] |= static_cast<cell>(
+            static_cast<ucell>(static_cast<unsigned char>(source[i])) << shift);
+      }
+    } else {
+      if (len >= size) {
+        len = size - 1;
+      }
+
+      for (std::size_t i = 0; i < len; ++i) {
+        dest[i] = static_cast<unsigned char>(source[i]);
+      }
+
+      dest[len] = 0;
+    }
+  }
+
+  std::vector<PublicHandler> handlers_;
+  std::vector<AMX_NATIVE> native_funcs_;
+
+ private:
+  template <typename T, typename... Args>
+  inline void PushArgs(T arg, Args... args) {
+    PushArgs(args...);
+
+    if constexpr (std::is_same<T, const char *>::value ||
+                  std::is_same<T, char *>::value) {
+      Push(AllotString(arg));
+    } else if constexpr (std::is_same<T, float>::value) {
+      cell value{};
+
+      std::memcpy(&value, &arg, sizeof(value));  // amx_ftoc
+      Push(value);
+    } else {
+      Push(static_cast<cell>(arg));
+    }
+  }
+
+  inline void PushArgs() {}
+
+  AMX amx_{};
+  std::unique_ptr<unsigned char[]> memory_;
+};
+
+// Implementations of the amx_* functions exported by the server
+namespace api {
+#define PTL_MOCK_DATA(amx)                                        \
+  reinterpret_cast<unsigned char *>(                              \
+      (amx)->data ? (amx)->data                                   \
+                  : (amx)->base + reinterpret_cast<AMX_HEADER *>( \
+                                      (amx)->base)                \
+                                      ->dat)
+
+inline uint16_t *AMXAPI Align16(uint16_t *v) { return v; }
+
+inline uint32_t *AMXAPI Align32(uint32_t *v) { return v; }
+
+inline uint64_t *AMXAPI Align64(uint64_t *v) { return v; }
+
+inline int AMXAPI Allot(AMX *amx, int cells, cell *amx_addr,
+                        cell **phys_addr) {
+  if (amx->stk - amx->hea - cells * static_cast<cell>(sizeof(cell)) <
+      static_cast<cell>(16 * sizeof(cell))) {
+    return AMX_ERR_MEMORY;
+  }
+
+  *amx_addr = amx->hea;
+
+  if (phys_addr) {
+    *phys_addr = reinterpret_cast<cell *>(PTL_MOCK_DATA(amx) + amx->hea);
+  }
+
+  amx->hea += cells * static_cast<cell>(sizeof(cell));
+
+  return AMX_ERR_NONE;
+}
+
+inline int AMXAPI Callback(AMX *, cell, cell *, cell *) {
+  return AMX_ERR_CALLBACK;
+}
+
+inline int AMXAPI Cleanup(AMX *) { return AMX_ERR_NONE; }
+
+inline int AMXAPI Clone(AMX *, AMX *, void *) { return AMX_ERR_INIT; }
+
+inline int AMXAPI Exec(AMX *amx, cell *retval, int index) {
+  auto &script = AmxScript::FromAmx(amx);
+
+  if (index < 0 || index >= static_cast<int>(script.handlers_.size())) {
+    amx->paramcount = 0;
+
+    return AMX_ERR_INDEX;
+  }
+
+  cell reset_stk = amx->stk;
+  cell reset_hea = amx->hea;
+  int paramcount = amx->paramcount;
+
+  amx->paramcount = 0;
+  amx->error = AMX_ERR_NONE;
+
+  script.Push(static_cast<cell>(paramcount * sizeof(cell)));
+
+  cell result = script.handlers_[index](script, script.PhysAddr(amx->stk));
+
+  int error = amx->error;
+
+  amx->error = AMX_ERR_NONE;
+
+  // RETN pops the parameters together with their count
+  amx->stk = reset_stk + paramcount * static_cast<cell>(sizeof(cell));
+
+  if (error != AMX_ERR_NONE) {
+    amx->hea = reset_hea;
+
+    return error;
+  }
+
+  if (retval) {
+    *retval = result;
+  }
+
+  return AMX_ERR_NONE;
+}
+
+inline int FindEntry(AMX *amx, int32_t table, int32_t next_table,
+                     const char *name) {
+  auto &script = AmxScript::FromAmx(amx);
+
+  for (int i = 0; i < script.NumEntries(table, next_table); ++i) {
+    if (!std::strcmp(script.EntryName(script.Stub(table, i)), name)) {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+// The table must be sorted by name
+inline int FindSortedEntry(AMX *amx, int32_t table, int32_t next_table,
+                           const char *name) {
+  auto &script = AmxScript::FromAmx(amx);
+  int low = 0;
+  int high = script.NumEntries(table, next_table) - 1;
+
+  while (low <= high) {
+    int mid = low + (high - low) / 2;
+    int result = std::strcmp(script.EntryName(script.Stub(table, mid)), name);
+
+    if (result == 0) {
+      return mid;
+    }
+
+    if (result < 0) {
+      low = mid + 1;
+    } else {
+      high = mid - 1;
+    }
+  }
+
+  return -1;
+}
+
+inline int AMXAPI FindNative(AMX *amx, const char *name, int *index) {
+  auto hdr = reinterpret_cast<AMX_HEADER *>(amx->base);
+
+  *index = FindEntry(amx, hdr->natives, hdr->libraries, name);
+
+  return *index < 0 ? AMX_ERR_NOTFOUND : AMX_ERR_NONE;
+}
+
+inline int AMXAPI FindPublic(AMX *amx, const char *funcname, int *index) {
+  auto hdr = reinterpret_cast<AMX_HEADER *>(amx->base);
+
+  *index = FindSortedEntry(amx, hdr->publics, hdr->natives, funcname);
+
+  return *index < 0 ? AMX_ERR_NOTFOUND : AMX_ERR_NONE;
+}
+
+inline int AMXAPI FindPubVar(AMX *amx, const char *varname, cell *amx_addr) {
+  auto hdr = reinterpret_cast<AMX_HEADER *>(amx->base);
+  int index = FindSortedEntry(amx, hdr->pubvars, hdr->tags, varname);
+
+  if (index < 0) {
+    return AMX_ERR_NOTFOUND;
+  }
+
+  *amx_addr = static_cast<cell>(
+      AmxScript::FromAmx(amx).Stub(hdr->pubvars, index)->address);
+
+  return AMX_ERR_NONE;
+}
+
+inline int AMXAPI FindTagId(AMX *, cell, char *) { return AMX_ERR_NOTFOUND; }
+
+inline int AMXAPI Flags(AMX *amx, uint16_t *flags) {
+  *flags = static_cast<uint16_t>(amx->flags);
+
+  return AMX_ERR_NONE;
+}
+
+inline int AMXAPI GetAddr(AMX *amx, cell amx_addr, cell **phys_addr) {
+  if ((amx_addr >= amx->hea && amx_addr < amx->stk) || amx_addr < 0 ||
+      amx_addr >= amx->stp) {
+    *phys_addr = nullptr;
+
+    return AMX_ERR_MEMACCESS;
+  }
+
+  *phys_addr = reinterpret_cast<cell *>(PTL_MOCK_DATA(amx) + amx_addr);
+
+  return AMX_ERR_NONE;
+}
+
+inline int GetEntryName(AMX *amx, int32_t table, int32_t next_table, int index,
+                        char *name) {
+  auto &script = AmxScript::FromAmx(amx);
+
+  if (index < 0 || index >= script.NumEntries(table, next_table)) {
+    *name = '\0';
+
+    return AMX_ERR_INDEX;
+  }
+
+  std::strcpy(name, script.EntryName(script.Stub(table, index)));
+
+  return AMX_ERR_NONE;
+}
+
+inline int AMXAPI GetNative(AMX *amx, int index, char *funcname) {
+  auto hdr = reinterpret_cast<AMX_HEADER *>(amx->base);
+
+  return GetEntryName(amx, hdr->natives, hdr->libraries, index, funcname);
+}
+
+inline int AMXAPI GetPublic(AMX *amx, int index, char *funcname) {
+  auto hdr = reinterpret_cast<AMX_HEADER *>(amx->base);
+
+  return GetEntryName(amx, hdr->publics, hdr->natives, index, funcname);
+}
+
+inline int AMXAPI GetPubVar(AMX *amx, int index, char *varname,
+                            cell *amx_addr) {
+  auto hdr = reinterpret_cast<AMX_HEADER *>(amx->base);
+  int result = GetEntryName(amx, hdr->pubvars, hdr->tags, index, varname);
+
+  if (result == AMX_ERR_NONE) {
+    *amx_addr = static_cast<cell>(
+        AmxScript::FromAmx(amx).Stub(hdr->pubvars, index)->address);
+  }
+
+  return result;
+}
+
+inline int AMXAPI GetString(char *dest, const cell *source, int use_wchar,
+                            size_t size) {
+  if (use_wchar) {
+    return AMX_ERR_PARAMS;
+  }
+
+  std::size_t i{};
+
+  if (static_cast<ucell>(*source) > UNPACKEDMAX) {
+    for (; i + 1 < size; ++i) {
+      int shift = static_cast<int>((sizeof(cell) - 1 - i % sizeof(cell)) * 8);
+      char c = static_cast<char>(
+          (static_cast<ucell>(source[i / sizeof(cell)]) >> shift) & 0xFF);
+
+      if (!c) {
+        break;
+      }
+
+      dest[i] = c;
+    }
+  } else {
+    for (; i + 1 < size && source[i]; ++i) {
+      dest[i] = static_cast<char>(source[i]);
+    }
+  }
+
+  dest[i] = '\0';
+
+  return AMX_ERR_NONE;
+}
+
+inline int AMXAPI GetTag(AMX *, int, char *, cell *) { return AMX_ERR_INDEX; }
+
+inline int AMXAPI GetUserData(AMX *amx, long tag, void **ptr) {
+  for (int i = 0; i < AMX_USERNUM; ++i) {
+    if (amx->usertags[i] == tag) {
+      *ptr = amx->userdata[i];
+
+      return AMX_ERR_NONE;
+    }
+  }
+
+  return AMX_ERR_USERDATA;
+}
+
+inline int AMXAPI Init(AMX *, void *) { return AMX_ERR_INIT; }
+
+inline int AMXAPI InitJIT(AMX *, void *, void *) { return AMX_ERR_INIT_JIT; }
+
+inline int AMXAPI MemInfo(AMX *amx, long *codesize, long *datasize,
+                          long *stackheap) {
+  auto hdr = reinterpret_cast<AMX_HEADER *>(amx->base);
+
+  *codesize = hdr->dat - hdr->cod;
+  *datasize = hdr->hea - hdr->dat;
+  *stackheap = hdr->stp - hdr->hea;
+
+  return AMX_ERR_NONE;
+}
+
+inline int AMXAPI NameLength(AMX *amx, int *length) {
+  auto hdr = reinterpret_cast<AMX_HEADER *>(amx->base);
+
+  *length = *reinterpret_cast<uint16_t *>(amx->base + hdr->nametable);
+
+  return AMX_ERR_NONE;
+}
+
+inline AMX_NATIVE_INFO *AMXAPI NativeInfo(const char *name, AMX_NATIVE func) {
+  static AMX_NATIVE_INFO info;
+
+  info.name = name;
+  info.func = func;
+
+  return &info;
+}
+
+inline int AMXAPI NumNatives(AMX *amx, int *number) {
+  auto hdr = reinterpret_cast<AMX_HEADER *>(amx->base);
+
+  *number = AmxScript::FromAmx(amx).NumEntries(hdr->natives, hdr->libraries);
+
+  return AMX_ERR_NONE;
+}
+
+inline int AMXAPI NumPublics(AMX *amx, int *number) {
+  auto hdr = reinterpret_cast<AMX_HEADER *>(amx->base);
+
+  *number = AmxScript::FromAmx(amx).NumEntries(hdr->publics, hdr->natives);
+
+  return AMX_ERR_NONE;
+}
+
+inline int AMXAPI NumPubVars(AMX *amx, int *number) {
+  auto hdr = reinterpret_cast<AMX_HEADER *>(amx->base);
+
+  *number = AmxScript::FromAmx(amx).NumEntries(hdr->pubvars, hdr->tags);
+
+  return AMX_ERR_NONE;
+}
+
+inline int AMXAPI NumTags(AMX *, int *number) {
+  *number = 0;
+
+  return AMX_ERR_NONE;
+}
+
+inline int AMXAPI Push(AMX *amx, cell value) {
+  if (amx->hea + static_cast<cell>(16 * sizeof(cell)) > amx->stk) {
+    return AMX_ERR_STACKERR;
+  }
+
+  amx->stk -= sizeof(cell);
+  amx->paramcount++;
+
+  *reinterpret_cast<cell *>(PTL_MOCK_DATA(amx) + amx->stk) = value;
+
+  return AMX_ERR_NONE;
+}
+
+inline int AMXAPI PushArray(AMX *amx, cell *amx_addr, cell **phys_addr,
+                            const cell array[], int numcells) {
+  cell *phys{};
+  int err = Allot(amx, numcells, amx_addr, &phys);
+
+  if (err != AMX_ERR_NONE) {
+    return err;
+  }
+
+  if (phys_addr) {
+    *phys_addr = phys;
+  }
+
+  if (array) {
+    std::memcpy(phys, array, numcells * sizeof(cell));
+  }
+
+  return Push(amx, *amx_addr);
+}
+
+inline int AMXAPI PushString(AMX *amx, cell *amx_addr, cell **phys_addr,
+                             const char *string, int pack, int use_wchar) {
+  if (use_wchar) {
+    return AMX_ERR_PARAMS;
+  }
+
+  std::size_t len = std::strlen(string);
+  int numcells = static_cast<int>(pack ? len / sizeof(cell) + 1 : len + 1);
+  cell *phys{};
+  int err = Allot(amx, numcells, amx_addr, &phys);
+
+  if (err != AMX_ERR_NONE) {
+    return err;
+  }
+
+  if (phys_addr) {
+    *phys_addr = phys;
+  }
+
+  AmxScript::SetString(phys, string, pack, numcells);
+
+  return Push(amx, *amx_addr);
+}
+
+inline int AMXAPI RaiseError(AMX *amx, int error) {
+  if (error != AMX_ERR_NONE) {
+    amx->error = error;
+  }
+
+  return AMX_ERR_NONE;
+}
+
+inline int AMXAPI Register(AMX *amx, const AMX_NATIVE_INFO *list, int number) {
+  auto &script = AmxScript::FromAmx(amx);
+  auto hdr = script.GetHeader();
+  int err = AMX_ERR_NONE;
+
+  for (int i = 0; i < script.NumEntries(hdr->natives, hdr->libraries); ++i) {
+    auto stub = script.Stub(hdr->natives, i);
+
+    if (!stub->address) {
+      for (int j = 0; (number < 0 || j < number) && list[j].name; ++j) {
+        if (!std::strcmp(list[j].name, script.EntryName(stub))) {
+          script.native_funcs_[i] = list[j].func;
+          stub->address = i + 1;
+
+          break;
+        }
+      }
+    }
+
+    if (!stub->address) {
+      err = AMX_ERR_NOTFOUND;
+    }
+  }
+
+  return err;
+}
+
+inline int AMXAPI Release(AMX *amx, cell amx_addr) {
+  if (amx->hea > amx_addr) {
+    amx->hea = amx_addr;
+  }
+
+  return AMX_ERR_NONE;
+}
+
+inline int AMXAPI SetCallback(AMX *amx, AMX_CALLBACK callback) {
+  amx->callback = callback;
+
+  return AMX_ERR_NONE;
+}
+
+inline int AMXAPI SetDebugHook(AMX *amx, AMX_DEBUG debug) {
+  amx->debug = debug;
+
+  return AMX_ERR_NONE;
+}
+
+inline int AMXAPI SetString(cell *dest, const char *source, int pack,
+                            int use_wchar, size_t size) {
+  if (use_wchar) {
+    return AMX_ERR_PARAMS;
+  }
+
+  AmxScript::SetString(dest, source, pack, size);
+
+  return AMX_ERR_NONE;
+}
+
+inline int AMXAPI SetUserData(AMX *amx, long tag, void *ptr) {
+  for (int i = 0; i < AMX_USERNUM; ++i) {
+    if (amx->usertags[i] == tag || amx->usertags[i] == 0) {
+      amx->usertags[i] = tag;
+      amx->userdata[i] = ptr;
+
+      return AMX_ERR_NONE;
+    }
+  }
+
+  return AMX_ERR_USERDATA;
+}
+
+inline int AMXAPI StrLen(const cell *cstring, int *length) {
+  int len{};
+
+  if (static_cast<ucell>(*cstring) > UNPACKEDMAX) {
+    for (;; ++len) {
+      int shift =
+          static_cast<int>((sizeof(cell) - 1 - len % sizeof(cell)) * 8);
+
+      if (!((static_cast<ucell>(cstring[len / sizeof(cell)]) >> shift) &
+            0xFF)) {
+        break;
+      }
+    }
+  } else {
+    while (cstring[len]) {
+      ++len;
+    }
+  }
+
+  *length = len;
+
+  return AMX_ERR_NONE;
+}
+
+inline int AMXAPI UTF8Check(const char *, int *) { return AMX_ERR_PARAMS; }
+
+inline int AMXAPI UTF8Get(const char *, const char **, cell *) {
+  return AMX_ERR_PARAMS;
+}
+
+inline int AMXAPI UTF8Len(const cell *, int *) { return AMX_ERR_PARAMS; }
+
+inline int AMXAPI UTF8Put(char *, char **, int, cell) {
+  return AMX_ERR_PARAMS;
+}
+
+#undef PTL_MOCK_DATA
+}  // namespace api
+
+class Host {
+ public:
+  Host() {
+    Instance() = this;
+
+    functions_[PLUGIN_AMX_EXPORT_Align16] = Fn(api::Align16);
+    functions_[PLUGIN_AMX_EXPORT_Align32] = Fn(api::Align32);
+    functions_[PLUGIN_AMX_EXPORT_Align64] = Fn(api::Align64);
+    functions_[PLUGIN_AMX_EXPORT_Allot] = Fn(api::Allot);
+    functions_[PLUGIN_AMX_EXPORT_Callback] = Fn(api::Callback);
+    functions_[PLUGIN_AMX_EXPORT_Cleanup] = Fn(api::Cleanup);
+    functions_[PLUGIN_AMX_EXPORT_Clone] = Fn(api::Clone);
+    functions_[PLUGIN_AMX_EXPORT_Exec] = Fn(api::Exec);
+    functions_[PLUGIN_AMX_EXPORT_FindNative] = Fn(api::FindNative);
+    functions_[PLUGIN_AMX_EXPORT_FindPublic] = Fn(api::FindPublic);
+    functions_[PLUGIN_AMX_EXPORT_FindPubVar] = Fn(api::FindPubVar);
+    functions_[PLUGIN_AMX_EXPORT_FindTagId] = Fn(api::FindTagId);
+    functions_[PLUGIN_AMX_EXPORT_Flags] = Fn(api::Flags);
+    functions_[PLUGIN_AMX_EXPORT_GetAddr] = Fn(api::GetAddr);
+    functions_[PLUGIN_AMX_EXPORT_GetNative] = Fn(api::GetNative);
+    functions_[PLUGIN_AMX_EXPORT_GetPublic] = Fn(api::GetPublic);
+    functions_[PLUGIN_AMX_EXPORT_GetPubVar] = Fn(api::GetPubVar);
+    functions_[PLUGIN_AMX_EXPORT_GetString] = Fn(api::GetString);
+    functions_[PLUGIN_AMX_EXPORT_GetTag] = Fn(api::GetTag);
+    functions_[PLUGIN_AMX_EXPORT_GetUserData] = Fn(api::GetUserData);
+    functions_[PLUGIN_AMX_EXPORT_Init] = Fn(api::Init);
+    functions_[PLUGIN_AMX_EXPORT_InitJIT] = Fn(api::InitJIT);
+    functions_[PLUGIN_AMX_EXPORT_MemInfo] = Fn(api::MemInfo);
+    functions_[PLUGIN_AMX_EXPORT_NameLength] = Fn(api::NameLength);
+    functions_[PLUGIN_AMX_EXPORT_NativeInfo] = Fn(api::NativeInfo);
+    functions_[PLUGIN_AMX_EXPORT_NumNatives] = Fn(api::NumNatives);
+    functions_[PLUGIN_AMX_EXPORT_NumPublics] = Fn(api::NumPublics);
+    functions_[PLUGIN_AMX_EXPORT_NumPubVars] = Fn(api::NumPubVars);
+    functions_[PLUGIN_AMX_EXPORT_NumTags] = Fn(api::NumTags);
+    functions_[PLUGIN_AMX_EXPORT_Push] = Fn(api::Push);
+    functions_[PLUGIN_AMX_EXPORT_PushArray] = Fn(api::PushArray);
+    functions_[PLUGIN_AMX_EXPORT_PushString] = Fn(api::PushString);
+    functions_[PLUGIN_AMX_EXPORT_RaiseError] = Fn(api::RaiseError);
+    functions_[PLUGIN_AMX_EXPORT_Register] = Fn(api::Register);
+    functions_[PLUGIN_AMX_EXPORT_Release] = Fn(api::Release);
+    functions_[PLUGIN_AMX_EXPORT_SetCallback] = Fn(api::SetCallback);
+    functions_[PLUGIN_AMX_EXPORT_SetDebugHook] = Fn(api::SetDebugHook);
+    functions_[PLUGIN_AMX_EXPORT_SetString] = Fn(api::SetString);
+    functions_[PLUGIN_AMX_EXPORT_SetUserData] = Fn(api::SetUserData);
+    functions_[PLUGIN_AMX_EXPORT_StrLen] = Fn(api::StrLen);
+    functions_[PLUGIN_AMX_EXPORT_UTF8Check] = Fn(api::UTF8Check);
+    functions_[PLUGIN_AMX_EXPORT_UTF8Get] = Fn(api::UTF8Get);
+    functions_[PLUGIN_AMX_EXPORT_UTF8Len] = Fn(api::UTF8Len);
+    functions_[PLUGIN_AMX_EXPORT_UTF8Put] = Fn(api::UTF8Put);
+
+    plugin_data_[PLUGIN_DATA_LOGPRINTF] =
+        reinterpret_cast<void *>(&Host::LogPrintf);
+    plugin_data_[PLUGIN_DATA_AMX_EXPORTS] = functions_;
+  }
+
+  ~Host() {
+    for (const auto &script : scripts_) {
+      AmxScript::Registry().erase(script->GetAmx());
+    }
+
+    scripts_.clear();
+
+    Instance() = nullptr;
+  }
+
+  Host(const Host &) = delete;
+  Host &operator=(const Host &) = delete;
+
+  // What the server passes to the plugin's Load
+  inline void **PluginData() { return plugin_data_; }
+
+  AmxScript &LoadScript(const AmxScriptSpec &spec) {
+    auto script = std::make_unique<AmxScript>(spec);
+
+    AmxScript::Registry()[script->GetAmx()] = script.get();
+
+    scripts_.push_back(std::move(script));
+
+    return *scripts_.back();
+  }
+
+  void UnloadScript(AmxScript &script) {
+    AmxScript::Registry().erase(script.GetAmx());
+
+    scripts_.erase(std::remove_if(scripts_.begin(), scripts_.end(),
+                                  [&script](const auto &s) {
+                                    return s.get() == &script;
+                                  }),
+                   scripts_.end());
+  }
+
+  // Messages printed through logprintf
+  inline std::vector<std::string> &Log() { return log_; }
+
+  inline void SetEchoLog(bool echo) { echo_log_ = echo; }
+
+  static void LogPrintf(const char *fmt, ...) {
+    char buf[1024];
+
+    va_list args;
+    va_start(args, fmt);
+    std::vsnprintf(buf, sizeof(buf), fmt, args);
+    va_end(args);
+
+    if (auto host = Instance()) {
+      host->log_.push_back(buf);
+
+      if (host->echo_log_) {
+        std::puts(buf);
+      }
+    }
+  }
+
+ private:
+  template <typename F>
+  static inline void *Fn(F func) {
+    return reinterpret_cast<void *>(func);
+  }
+
+  static Host *&Instance() {
+    static Host *instance{};
+
+    return instance;
+  }
+
+  void *functions_[PLUGIN_AMX_EXPORT_UTF8Put + 1]{};
+  void *plugin_data_[MAX_PLUGIN_DATA]{};
+
+  std::vector<std::unique_ptr<AmxScript>> scripts_;
+  std::vector<std::string> log_;
+  bool echo_log_{};
+};
+}  // namespace ptl::mock
+
+#endif  // PTL_MOCK_AMX_HOST_H_
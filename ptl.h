@@ -26,335 +26,2056 @@
 #define PTL_H_
 
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdarg>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
 #include <functional>
 #include <list>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <optional>
 #include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
 #include <tuple>
+#include <type_traits>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
 #include "amx/amx.h"
 #include "plugincommon.h"
 
+#if defined __i386__ || defined __x86_64__ || defined _M_IX86 || \
+    defined _M_X64
+#define PTL_X86
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+#endif
+
+// SIMD string kernels need 32-bit cells and an x86 target. Both SSE2 and
+// AVX2 are checked at runtime, CPUs without SSE2 get the scalar kernels
+#if defined PTL_X86 && PAWN_CELL_SIZE == 32 && !defined PTL_NO_SIMD
+#define PTL_SIMD_KERNELS
+#include <immintrin.h>
+#ifdef _MSC_VER
+#define PTL_TARGET(isa)
+#define PTL_NO_ASAN
+#else
+#define PTL_TARGET(isa) __attribute__((target(isa)))
+#define PTL_NO_ASAN __attribute__((no_sanitize_address))
+#endif
+#endif
+
 #define PACK_PLUGIN_VERSION(major, minor, patch) \
   (((major) << 16) | ((minor) << 8) | (patch))
 
+// printf-style format checking of a function's arguments (1-based, `this`
+// counts for member functions)
+#ifdef _MSC_VER
+#define PTL_PRINTF_FORMAT(fmt_index, args_index)
+#else
+#define PTL_PRINTF_FORMAT(fmt_index, args_index) \
+  __attribute__((format(printf, fmt_index, args_index)))
+#endif
+
+// Format string checked at compile time against the Log arguments
+#define PTL_FMT(str)                                     \
+  [] {                                                   \
+    struct Fmt : ::ptl::FormatString {                   \
+      static constexpr const char *Get() { return str; } \
+    };                                                   \
+                                                         \
+    return Fmt{};                                        \
+  }()
+
 namespace ptl {  // Plugin Template Library
 using LogPrintf = void (*)(const char *fmt, ...);
 
-class Amx {
- public:
-  Amx(AMX *amx, void *amx_functions, bool log_amx_errors, LogPrintf logprintf,
-      const std::string &plugin_name)
-      : amx_{amx},
-        amx_functions_{amx_functions},
-        log_amx_errors_{log_amx_errors},
-        logprintf_{logprintf},
-        plugin_name_{plugin_name} {}
+// amx_ftoc/amx_ctof without the type punning
+using CellFloat = std::conditional_t<sizeof(cell) == 8, double, float>;
 
-  uint16_t *Align16(uint16_t *v) {
-    return Call<PLUGIN_AMX_EXPORT_Align16, false, uint16_t *>(v);
+inline cell FloatToCell(float value) {
+  CellFloat float_value = value;
+  cell result{};
+
+  std::memcpy(&result, &float_value, sizeof(result));
+
+  return result;
+}
+
+inline float CellToFloat(cell value) {
+  CellFloat result{};
+
+  std::memcpy(&result, &value, sizeof(result));
+
+  return static_cast<float>(result);
+}
+
+// Typed copy of the AMX function table exported by the server
+// (PLUGIN_DATA_AMX_EXPORTS). Filled once per plugin and shared by every Amx
+struct AmxApi {
+  void Load(void *amx_functions) {
+    table = static_cast<void **>(amx_functions);
+
+    Resolve(PLUGIN_AMX_EXPORT_Align16, Align16);
+    Resolve(PLUGIN_AMX_EXPORT_Align32, Align32);
+#if defined _I64_MAX || defined HAVE_I64
+    Resolve(PLUGIN_AMX_EXPORT_Align64, Align64);
+#endif
+    Resolve(PLUGIN_AMX_EXPORT_Allot, Allot);
+    Resolve(PLUGIN_AMX_EXPORT_Callback, Callback);
+    Resolve(PLUGIN_AMX_EXPORT_Cleanup, Cleanup);
+    Resolve(PLUGIN_AMX_EXPORT_Clone, Clone);
+    Resolve(PLUGIN_AMX_EXPORT_Exec, Exec);
+    Resolve(PLUGIN_AMX_EXPORT_FindNative, FindNative);
+    Resolve(PLUGIN_AMX_EXPORT_FindPublic, FindPublic);
+    Resolve(PLUGIN_AMX_EXPORT_FindPubVar, FindPubVar);
+    Resolve(PLUGIN_AMX_EXPORT_FindTagId, FindTagId);
+    Resolve(PLUGIN_AMX_EXPORT_Flags, Flags);
+    Resolve(PLUGIN_AMX_EXPORT_GetAddr, GetAddr);
+    Resolve(PLUGIN_AMX_EXPORT_GetNative, GetNative);
+    Resolve(PLUGIN_AMX_EXPORT_GetPublic, GetPublic);
+    Resolve(PLUGIN_AMX_EXPORT_GetPubVar, GetPubVar);
+    Resolve(PLUGIN_AMX_EXPORT_GetString, GetString);
+    Resolve(PLUGIN_AMX_EXPORT_GetTag, GetTag);
+    Resolve(PLUGIN_AMX_EXPORT_GetUserData, GetUserData);
+    Resolve(PLUGIN_AMX_EXPORT_Init, Init);
+    Resolve(PLUGIN_AMX_EXPORT_InitJIT, InitJIT);
+    Resolve(PLUGIN_AMX_EXPORT_MemInfo, MemInfo);
+    Resolve(PLUGIN_AMX_EXPORT_NameLength, NameLength);
+    Resolve(PLUGIN_AMX_EXPORT_NativeInfo, NativeInfo);
+    Resolve(PLUGIN_AMX_EXPORT_NumNatives, NumNatives);
+    Resolve(PLUGIN_AMX_EXPORT_NumPublics, NumPublics);
+    Resolve(PLUGIN_AMX_EXPORT_NumPubVars, NumPubVars);
+    Resolve(PLUGIN_AMX_EXPORT_NumTags, NumTags);
+    Resolve(PLUGIN_AMX_EXPORT_Push, Push);
+    Resolve(PLUGIN_AMX_EXPORT_PushArray, PushArray);
+    Resolve(PLUGIN_AMX_EXPORT_PushString, PushString);
+    Resolve(PLUGIN_AMX_EXPORT_RaiseError, RaiseError);
+    Resolve(PLUGIN_AMX_EXPORT_Register, Register);
+    Resolve(PLUGIN_AMX_EXPORT_Release, Release);
+    Resolve(PLUGIN_AMX_EXPORT_SetCallback, SetCallback);
+    Resolve(PLUGIN_AMX_EXPORT_SetDebugHook, SetDebugHook);
+    Resolve(PLUGIN_AMX_EXPORT_SetString, SetString);
+    Resolve(PLUGIN_AMX_EXPORT_SetUserData, SetUserData);
+    Resolve(PLUGIN_AMX_EXPORT_StrLen, StrLen);
+    Resolve(PLUGIN_AMX_EXPORT_UTF8Check, UTF8Check);
+    Resolve(PLUGIN_AMX_EXPORT_UTF8Get, UTF8Get);
+    Resolve(PLUGIN_AMX_EXPORT_UTF8Len, UTF8Len);
+    Resolve(PLUGIN_AMX_EXPORT_UTF8Put, UTF8Put);
   }
 
-  uint32_t *Align32(uint32_t *v) {
-    return Call<PLUGIN_AMX_EXPORT_Align32, false, uint32_t *>(v);
+  template <typename Func>
+  inline void Resolve(PLUGIN_AMX_EXPORT func, Func &ptr) {
+    ptr = reinterpret_cast<Func>(table[func]);
   }
 
+  void **table{};
+
+  // GetAddr, Push, Release and StrLen are done by Amx itself instead of
+  // calling the exported functions. Off by default: any hook another plugin
+  // installed on those exports would be bypassed
+  bool inline_calls{};
+
+  decltype(&amx_Align16) Align16{};
+  decltype(&amx_Align32) Align32{};
 #if defined _I64_MAX || defined HAVE_I64
-  uint64_t *Align64(uint64_t *v) {
-    return Call<PLUGIN_AMX_EXPORT_Align64, false, uint64_t *>(v);
-  }
+  decltype(&amx_Align64) Align64{};
 #endif
+  decltype(&amx_Allot) Allot{};
+  decltype(&amx_Callback) Callback{};
+  decltype(&amx_Cleanup) Cleanup{};
+  decltype(&amx_Clone) Clone{};
+  decltype(&amx_Exec) Exec{};
+  decltype(&amx_FindNative) FindNative{};
+  decltype(&amx_FindPublic) FindPublic{};
+  decltype(&amx_FindPubVar) FindPubVar{};
+  decltype(&amx_FindTagId) FindTagId{};
+  decltype(&amx_Flags) Flags{};
+  decltype(&amx_GetAddr) GetAddr{};
+  decltype(&amx_GetNative) GetNative{};
+  decltype(&amx_GetPublic) GetPublic{};
+  decltype(&amx_GetPubVar) GetPubVar{};
+  decltype(&amx_GetString) GetString{};
+  decltype(&amx_GetTag) GetTag{};
+  decltype(&amx_GetUserData) GetUserData{};
+  decltype(&amx_Init) Init{};
+  decltype(&amx_InitJIT) InitJIT{};
+  decltype(&amx_MemInfo) MemInfo{};
+  decltype(&amx_NameLength) NameLength{};
+  decltype(&amx_NativeInfo) NativeInfo{};
+  decltype(&amx_NumNatives) NumNatives{};
+  decltype(&amx_NumPublics) NumPublics{};
+  decltype(&amx_NumPubVars) NumPubVars{};
+  decltype(&amx_NumTags) NumTags{};
+  decltype(&amx_Push) Push{};
+  decltype(&amx_PushArray) PushArray{};
+  decltype(&amx_PushString) PushString{};
+  decltype(&amx_RaiseError) RaiseError{};
+  decltype(&amx_Register) Register{};
+  decltype(&amx_Release) Release{};
+  decltype(&amx_SetCallback) SetCallback{};
+  decltype(&amx_SetDebugHook) SetDebugHook{};
+  decltype(&amx_SetString) SetString{};
+  decltype(&amx_SetUserData) SetUserData{};
+  decltype(&amx_StrLen) StrLen{};
+  decltype(&amx_UTF8Check) UTF8Check{};
+  decltype(&amx_UTF8Get) UTF8Get{};
+  decltype(&amx_UTF8Len) UTF8Len{};
+  decltype(&amx_UTF8Put) UTF8Put{};
+};
 
-  template <bool raise_error = true>
-  int Allot(int cells, cell *amx_addr, cell **phys_addr) {
-    return Call<PLUGIN_AMX_EXPORT_Allot, raise_error>(amx_, cells, amx_addr,
-                                                      phys_addr);
+// Cell <-> char string conversion. Every string that crosses the C++/Pawn
+// boundary goes through these, so on x86 there are SSE2 and AVX2 versions,
+// picked once at runtime through CPUID
+class StringKernels {
+ public:
+  static inline bool IsPacked(const cell *src) {
+    return static_cast<ucell>(*src) > UNPACKEDMAX;
   }
 
-  template <bool raise_error = true>
-  int Callback(cell index, cell *result, cell *params) {
-    return Call<PLUGIN_AMX_EXPORT_Callback, raise_error>(amx_, index, result,
-                                                         params);
+  // Number of characters before the terminator, packed or unpacked
+  static inline std::size_t Length(const cell *src) {
+    return IsPacked(src) ? Get().packed_length(src)
+                         : Get().unpacked_length(src);
   }
 
-  template <bool raise_error = true>
-  int Cleanup() {
-    return Call<PLUGIN_AMX_EXPORT_Cleanup, raise_error>(amx_);
+  // Writes len characters of a packed or unpacked string, no terminator
+  static inline void Narrow(char *dest, const cell *src, std::size_t len) {
+    if (IsPacked(src)) {
+      Get().unpack(dest, src, len);
+    } else {
+      Get().narrow(dest, src, len);
+    }
   }
 
-  template <bool raise_error = true>
-  int Clone(AMX *amx_clone, void *data) {
-    return Call<PLUGIN_AMX_EXPORT_Clone, raise_error>(amx_clone, amx_, data);
+  // Writes len unpacked characters, no terminator
+  static inline void Widen(cell *dest, const char *src, std::size_t len) {
+    Get().widen(dest, src, len);
   }
 
-  template <bool raise_error = true>
-  int Exec(cell *retval, int index, const std::string &debug_args_values = "") {
-    int result = Call<PLUGIN_AMX_EXPORT_Exec, false>(amx_, retval, index);
+  static inline const char *Isa() { return Get().isa; }
 
-    if constexpr (raise_error) {
-      if (log_amx_errors_ && result != AMX_ERR_NONE) {
-        Log(StrError(result) + " in public " + GetPublicName(index) + "(" +
-            debug_args_values +
-            ") - please note that the AMX error is not related with the "
-            "plugin, but your script");
-      }
-    }
+ private:
+  struct Table {
+    const char *isa;
+    std::size_t (*unpacked_length)(const cell *src);
+    std::size_t (*packed_length)(const cell *src);
+    void (*narrow)(char *dest, const cell *src, std::size_t len);
+    void (*unpack)(char *dest, const cell *src, std::size_t len);
+    void (*widen)(cell *dest, const char *src, std::size_t len);
+  };
 
-    return result;
-  }
+  static inline const Table &Get() {
+    static const Table table = Select();
 
-  template <bool raise_error = true>
-  int FindNative(const char *name, int *index) {
-    return Call<PLUGIN_AMX_EXPORT_FindNative, raise_error>(amx_, name, index);
+    return table;
   }
 
-  template <bool raise_error = true>
-  int FindPublic(const char *funcname, int *index) {
-    return Call<PLUGIN_AMX_EXPORT_FindPublic, raise_error>(amx_, funcname,
-                                                           index);
-  }
+  static Table Select() {
+#ifdef PTL_SIMD_KERNELS
+    if (CpuHasAvx2()) {
+      return {"avx2",          Avx2UnpackedLength, Sse2PackedLength,
+              Avx2Narrow,      Avx2Unpack,         Avx2Widen};
+    }
 
-  template <bool raise_error = true>
-  int FindPubVar(const char *varname, cell *amx_addr) {
-    return Call<PLUGIN_AMX_EXPORT_FindPubVar, raise_error>(amx_, varname,
-                                                           amx_addr);
+    if (CpuHasSse2()) {
+      return {"sse2",     Sse2UnpackedLength, Sse2PackedLength,
+              Sse2Narrow, Sse2Unpack,         Sse2Widen};
+    }
+#endif
+    return {"scalar",     ScalarUnpackedLength, ScalarPackedLength,
+            ScalarNarrow, ScalarUnpack,         ScalarWiden};
   }
 
-  template <bool raise_error = true>
-  int FindTagId(cell tag_id, char *tagname) {
-    return Call<PLUGIN_AMX_EXPORT_FindTagId, raise_error>(amx_, tag_id,
-                                                          tagname);
-  }
+  static std::size_t ScalarUnpackedLength(const cell *src) {
+    std::size_t len{};
 
-  template <bool raise_error = true>
-  int Flags(uint16_t *flags) {
-    return Call<PLUGIN_AMX_EXPORT_Flags, raise_error>(amx_, flags);
-  }
+    while (src[len]) {
+      ++len;
+    }
 
-  template <bool raise_error = true>
-  int GetAddr(cell amx_addr, cell **phys_addr) {
-    return Call<PLUGIN_AMX_EXPORT_GetAddr, raise_error>(amx_, amx_addr,
-                                                        phys_addr);
+    return len;
   }
 
-  template <bool raise_error = true>
-  int GetNative(int index, char *funcname) {
-    return Call<PLUGIN_AMX_EXPORT_GetNative, raise_error>(amx_, index,
-                                                          funcname);
-  }
+  // Characters are stored from the most significant byte
+  static inline std::size_t PackedBytes(ucell value) {
+    std::size_t bytes{};
 
-  template <bool raise_error = true>
-  int GetPublic(int index, char *funcname) {
-    return Call<PLUGIN_AMX_EXPORT_GetPublic, raise_error>(amx_, index,
-                                                          funcname);
-  }
+    for (int shift = (sizeof(cell) - 1) * 8; shift >= 0; shift -= 8) {
+      if (!((value >> shift) & 0xFF)) {
+        break;
+      }
 
-  template <bool raise_error = true>
-  int GetPubVar(int index, char *varname, cell *amx_addr) {
-    return Call<PLUGIN_AMX_EXPORT_GetPubVar, raise_error>(amx_, index, varname,
-                                                          amx_addr);
-  }
+      ++bytes;
+    }
 
-  template <bool raise_error = true>
-  int GetString(char *dest, const cell *source, int use_wchar,
-                std::size_t size) {
-    return Call<PLUGIN_AMX_EXPORT_GetString, raise_error>(dest, source,
-                                                          use_wchar, size);
+    return bytes;
   }
 
-  template <bool raise_error = true>
-  int GetTag(int index, char *tagname, cell *tag_id) {
-    return Call<PLUGIN_AMX_EXPORT_GetTag, raise_error>(amx_, index, tagname,
-                                                       tag_id);
-  }
+  static std::size_t ScalarPackedLength(const cell *src) {
+    std::size_t len{};
 
-  template <bool raise_error = true>
-  int GetUserData(long tag, void **ptr) {
-    return Call<PLUGIN_AMX_EXPORT_GetUserData, raise_error>(amx_, tag, ptr);
-  }
+    for (;; ++src) {
+      std::size_t bytes = PackedBytes(static_cast<ucell>(*src));
 
-  template <bool raise_error = true>
-  int Init(void *program) {
-    return Call<PLUGIN_AMX_EXPORT_Init, raise_error>(amx_, program);
-  }
+      len += bytes;
 
-  template <bool raise_error = true>
-  int InitJIT(void *reloc_table, void *native_code) {
-    return Call<PLUGIN_AMX_EXPORT_InitJIT, raise_error>(amx_, reloc_table,
-                                                        native_code);
+      if (bytes != sizeof(cell)) {
+        return len;
+      }
+    }
   }
 
-  template <bool raise_error = true>
-  int MemInfo(long *codesize, long *datasize, long *stackheap) {
-    return Call<PLUGIN_AMX_EXPORT_MemInfo, raise_error>(amx_, codesize,
-                                                        datasize, stackheap);
+  static void ScalarNarrow(char *dest, const cell *src, std::size_t len) {
+    for (std::size_t i = 0; i < len; ++i) {
+      dest[i] = static_cast<char>(src[i]);
+    }
   }
 
-  template <bool raise_error = true>
-  int NameLength(int *length) {
-    return Call<PLUGIN_AMX_EXPORT_NameLength, raise_error>(amx_, length);
-  }
+  static void ScalarUnpack(char *dest, const cell *src, std::size_t len) {
+    for (std::size_t i = 0; i < len; ++i) {
+      ucell value = static_cast<ucell>(src[i / sizeof(cell)]);
+      int shift = (sizeof(cell) - 1 - i % sizeof(cell)) * 8;
 
-  AMX_NATIVE_INFO *NativeInfo(const char *name, AMX_NATIVE func) {
-    return Call<PLUGIN_AMX_EXPORT_NativeInfo, false, AMX_NATIVE_INFO *>(name,
-                                                                        func);
+      dest[i] = static_cast<char>((value >> shift) & 0xFF);
+    }
   }
 
-  template <bool raise_error = true>
-  int NumNatives(int *number) {
-    return Call<PLUGIN_AMX_EXPORT_NumNatives, raise_error>(amx_, number);
+  static void ScalarWiden(cell *dest, const char *src, std::size_t len) {
+    for (std::size_t i = 0; i < len; ++i) {
+      dest[i] = static_cast<unsigned char>(src[i]);
+    }
   }
 
-  template <bool raise_error = true>
-  int NumPublics(int *number) {
-    return Call<PLUGIN_AMX_EXPORT_NumPublics, raise_error>(amx_, number);
-  }
+#ifdef PTL_SIMD_KERNELS
+  // Always there on x86-64, but not on every CPU an i386 build may run on
+  static bool CpuHasSse2() {
+#ifdef _MSC_VER
+    int regs[4]{};
 
-  template <bool raise_error = true>
-  int NumPubVars(int *number) {
-    return Call<PLUGIN_AMX_EXPORT_NumPubVars, raise_error>(amx_, number);
-  }
+    __cpuid(regs, 1);
 
-  template <bool raise_error = true>
-  int NumTags(int *number) {
-    return Call<PLUGIN_AMX_EXPORT_NumTags, raise_error>(amx_, number);
-  }
+    return regs[3] & (1 << 26);
+#else
+    __builtin_cpu_init();
 
-  template <bool raise_error = true>
-  int Push(cell value) {
-    return Call<PLUGIN_AMX_EXPORT_Push, raise_error>(amx_, value);
+    return __builtin_cpu_supports("sse2");
+#endif
   }
 
-  template <bool raise_error = true>
-  int PushArray(cell *amx_addr, cell **phys_addr, const cell array[],
-                int numcells) {
-    return Call<PLUGIN_AMX_EXPORT_PushArray, raise_error>(
-        amx_, amx_addr, phys_addr, array, numcells);
-  }
+  static bool CpuHasAvx2() {
+#ifdef _MSC_VER
+    int regs[4]{};
 
-  template <bool raise_error = true>
-  int PushString(cell *amx_addr, cell **phys_addr, const char *string, int pack,
-                 int use_wchar) {
-    return Call<PLUGIN_AMX_EXPORT_PushString, raise_error>(
-        amx_, amx_addr, phys_addr, string, pack, use_wchar);
+    __cpuid(regs, 0);
+
+    if (regs[0] < 7) {
+      return false;
+    }
+
+    __cpuid(regs, 1);
+
+    bool osxsave = regs[2] & (1 << 27);
+    bool avx = regs[2] & (1 << 28);
+
+    // The OS must save the YMM registers on context switches
+    if (!osxsave || !avx || (_xgetbv(0) & 6) != 6) {
+      return false;
+    }
+
+    __cpuidex(regs, 7, 0);
+
+    return regs[1] & (1 << 5);
+#else
+    __builtin_cpu_init();
+
+    return __builtin_cpu_supports("avx2");
+#endif
   }
 
-  template <bool raise_error = true>
-  int RaiseError(int error) {
-    return Call<PLUGIN_AMX_EXPORT_RaiseError, raise_error>(amx_, error);
+  static inline unsigned CountTrailingZeros(unsigned mask) {
+#ifdef _MSC_VER
+    unsigned long index{};
+
+    _BitScanForward(&index, mask);
+
+    return index;
+#else
+    return __builtin_ctz(mask);
+#endif
   }
 
-  template <bool raise_error = true>
-  int Register(const AMX_NATIVE_INFO *nativelist, int number) {
-    return Call<PLUGIN_AMX_EXPORT_Register, raise_error>(amx_, nativelist,
-                                                         number);
+  // Aligned loads never cross a page boundary, so reading past the
+  // terminator inside the same vector is safe (but not for ASan)
+  PTL_TARGET("sse2") PTL_NO_ASAN
+  static std::size_t Sse2UnpackedLength(const cell *src) {
+    std::size_t len{};
+
+    for (; reinterpret_cast<std::uintptr_t>(src + len) % 16; ++len) {
+      if (!src[len]) {
+        return len;
+      }
+    }
+
+    const __m128i zero = _mm_setzero_si128();
+
+    for (;; len += 4) {
+      __m128i v =
+          _mm_load_si128(reinterpret_cast<const __m128i *>(src + len));
+      unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi32(v, zero));
+
+      if (mask) {
+        return len + CountTrailingZeros(mask) / sizeof(cell);
+      }
+    }
   }
 
-  template <bool raise_error = true>
-  int Release(cell amx_addr) {
-    return Call<PLUGIN_AMX_EXPORT_Release, raise_error>(amx_, amx_addr);
+  PTL_TARGET("sse2") PTL_NO_ASAN
+  static std::size_t Sse2PackedLength(const cell *src) {
+    std::size_t cells{};
+
+    for (; reinterpret_cast<std::uintptr_t>(src + cells) % 16; ++cells) {
+      std::size_t bytes = PackedBytes(static_cast<ucell>(src[cells]));
+
+      if (bytes != sizeof(cell)) {
+        return cells * sizeof(cell) + bytes;
+      }
+    }
+
+    const __m128i zero = _mm_setzero_si128();
+
+    for (;; cells += 4) {
+      __m128i v =
+          _mm_load_si128(reinterpret_cast<const __m128i *>(src + cells));
+      unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, zero));
+
+      if (mask) {
+        // The first cell with a zero byte holds the terminator
+        cells += CountTrailingZeros(mask) / sizeof(cell);
+
+        return cells * sizeof(cell) +
+               PackedBytes(static_cast<ucell>(src[cells]));
+      }
+    }
   }
 
-  template <bool raise_error = true>
-  int SetCallback(AMX_CALLBACK callback) {
-    return Call<PLUGIN_AMX_EXPORT_SetCallback, raise_error>(amx_, callback);
+  PTL_TARGET("sse2")
+  static void Sse2Narrow(char *dest, const cell *src, std::size_t len) {
+    const __m128i low_byte = _mm_set1_epi32(0xFF);
+    std::size_t i{};
+
+    for (; i + 16 <= len; i += 16) {
+      const __m128i *in = reinterpret_cast<const __m128i *>(src + i);
+      __m128i a = _mm_and_si128(_mm_loadu_si128(in), low_byte);
+      __m128i b = _mm_and_si128(_mm_loadu_si128(in + 1), low_byte);
+      __m128i c = _mm_and_si128(_mm_loadu_si128(in + 2), low_byte);
+      __m128i d = _mm_and_si128(_mm_loadu_si128(in + 3), low_byte);
+
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(dest + i),
+                       _mm_packus_epi16(_mm_packs_epi32(a, b),
+                                        _mm_packs_epi32(c, d)));
+    }
+
+    ScalarNarrow(dest + i, src + i, len - i);
   }
 
-  template <bool raise_error = true>
-  int SetDebugHook(AMX_DEBUG debug) {
-    return Call<PLUGIN_AMX_EXPORT_SetDebugHook, raise_error>(amx_, debug);
+  PTL_TARGET("sse2")
+  static void Sse2Unpack(char *dest, const cell *src, std::size_t len) {
+    std::size_t i{};
+
+    for (; i + 16 <= len; i += 16) {
+      __m128i v = _mm_loadu_si128(
+          reinterpret_cast<const __m128i *>(src + i / sizeof(cell)));
+
+      // Swap the bytes of each 16-bit half, then the halves themselves
+      v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+      v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+      v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(dest + i), v);
+    }
+
+    ScalarUnpack(dest + i, src + i / sizeof(cell), len - i);
   }
 
-  template <bool raise_error = true>
-  int SetString(cell *dest, const char *source, int pack, int use_wchar,
-                std::size_t size) {
-    return Call<PLUGIN_AMX_EXPORT_SetString, raise_error>(dest, source, pack,
-                                                          use_wchar, size);
+  PTL_TARGET("sse2")
+  static void Sse2Widen(cell *dest, const char *src, std::size_t len) {
+    const __m128i zero = _mm_setzero_si128();
+    std::size_t i{};
+
+    for (; i + 16 <= len; i += 16) {
+      __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+      __m128i lo = _mm_unpacklo_epi8(v, zero);
+      __m128i hi = _mm_unpackhi_epi8(v, zero);
+      __m128i *out = reinterpret_cast<__m128i *>(dest + i);
+
+      _mm_storeu_si128(out, _mm_unpacklo_epi16(lo, zero));
+      _mm_storeu_si128(out + 1, _mm_unpackhi_epi16(lo, zero));
+      _mm_storeu_si128(out + 2, _mm_unpacklo_epi16(hi, zero));
+      _mm_storeu_si128(out + 3, _mm_unpackhi_epi16(hi, zero));
+    }
+
+    ScalarWiden(dest + i, src + i, len - i);
   }
 
-  template <bool raise_error = true>
-  int SetUserData(long tag, void *ptr) {
-    return Call<PLUGIN_AMX_EXPORT_SetUserData, raise_error>(amx_, tag, ptr);
+  PTL_TARGET("avx2") PTL_NO_ASAN
+  static std::size_t Avx2UnpackedLength(const cell *src) {
+    std::size_t len{};
+
+    for (; reinterpret_cast<std::uintptr_t>(src + len) % 32; ++len) {
+      if (!src[len]) {
+        return len;
+      }
+    }
+
+    const __m256i zero = _mm256_setzero_si256();
+
+    for (;; len += 8) {
+      __m256i v =
+          _mm256_load_si256(reinterpret_cast<const __m256i *>(src + len));
+      unsigned mask = _mm256_movemask_ps(
+          _mm256_castsi256_ps(_mm256_cmpeq_epi32(v, zero)));
+
+      if (mask) {
+        return len + CountTrailingZeros(mask);
+      }
+    }
   }
 
-  template <bool raise_error = true>
-  int StrLen(const cell *cstring, int *length) {
-    return Call<PLUGIN_AMX_EXPORT_StrLen, raise_error>(cstring, length);
+  PTL_TARGET("avx2")
+  static void Avx2Narrow(char *dest, const cell *src, std::size_t len) {
+    const __m256i low_byte = _mm256_set1_epi32(0xFF);
+    // packs/packus work within 128-bit lanes, this puts the dwords back
+    const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    std::size_t i{};
+
+    for (; i + 32 <= len; i += 32) {
+      const __m256i *in = reinterpret_cast<const __m256i *>(src + i);
+      __m256i a = _mm256_and_si256(_mm256_loadu_si256(in), low_byte);
+      __m256i b = _mm256_and_si256(_mm256_loadu_si256(in + 1), low_byte);
+      __m256i c = _mm256_and_si256(_mm256_loadu_si256(in + 2), low_byte);
+      __m256i d = _mm256_and_si256(_mm256_loadu_si256(in + 3), low_byte);
+      __m256i bytes = _mm256_packus_epi16(_mm256_packs_epi32(a, b),
+                                          _mm256_packs_epi32(c, d));
+
+      _mm256_storeu_si256(reinterpret_cast<__m256i *>(dest + i),
+                          _mm256_permutevar8x32_epi32(bytes, order));
+    }
+
+    Sse2Narrow(dest + i, src + i, len - i);
   }
 
-  template <bool raise_error = true>
-  int UTF8Check(const char *string, int *length) {
-    return Call<PLUGIN_AMX_EXPORT_UTF8Check, raise_error>(string, length);
+  PTL_TARGET("avx2")
+  static void Avx2Unpack(char *dest, const cell *src, std::size_t len) {
+    const __m256i swap = _mm256_setr_epi8(
+        3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,  //
+        3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    std::size_t i{};
+
+    for (; i + 32 <= len; i += 32) {
+      __m256i v = _mm256_loadu_si256(
+          reinterpret_cast<const __m256i *>(src + i / sizeof(cell)));
+
+      _mm256_storeu_si256(reinterpret_cast<__m256i *>(dest + i),
+                          _mm256_shuffle_epi8(v, swap));
+    }
+
+    Sse2Unpack(dest + i, src + i / sizeof(cell), len - i);
   }
 
-  template <bool raise_error = true>
-  int UTF8Get(const char *string, const char **endptr, cell *value) {
-    return Call<PLUGIN_AMX_EXPORT_UTF8Get, raise_error>(string, endptr, value);
+  PTL_TARGET("avx2")
+  static void Avx2Widen(cell *dest, const char *src, std::size_t len) {
+    std::size_t i{};
+
+    for (; i + 32 <= len; i += 32) {
+      __m256i *out = reinterpret_cast<__m256i *>(dest + i);
+
+      for (int j = 0; j < 4; ++j) {
+        __m128i v = _mm_loadl_epi64(
+            reinterpret_cast<const __m128i *>(src + i + j * 8));
+
+        _mm256_storeu_si256(out + j, _mm256_cvtepu8_epi32(v));
+      }
+    }
+
+    Sse2Widen(dest + i, src + i, len - i);
   }
+#endif
+};
 
-  template <bool raise_error = true>
-  int UTF8Len(const cell *cstr, int *length) {
-    return Call<PLUGIN_AMX_EXPORT_UTF8Len, raise_error>(cstr, length);
+// Call statistics of a native or a public. The counters come first and the
+// entry is padded to a cache line, so hot entries never share one
+struct alignas(64) CallStats {
+  std::uint64_t calls{};
+  std::uint64_t errors{};
+  std::uint64_t total_ns{};
+  std::uint64_t max_ns{};
+  bool is_public{};
+  std::string name;
+};
+
+// Per-native and per-public call statistics. Only collected when
+// PTL_ENABLE_STATS is defined, otherwise Find returns null and CallTimer
+// compiles to nothing
+class Stats {
+ public:
+#ifdef PTL_ENABLE_STATS
+  static constexpr bool enabled = true;
+#else
+  static constexpr bool enabled = false;
+#endif
+
+  static CallStats *Native(const std::string &name) {
+    return Find(name, false);
   }
 
-  template <bool raise_error = true>
-  int UTF8Put(char *string, char **endptr, int maxchars, cell value) {
-    return Call<PLUGIN_AMX_EXPORT_UTF8Put, raise_error>(string, endptr,
-                                                        maxchars, value);
+  static CallStats *Public(const std::string &name) {
+    return Find(name, true);
   }
 
-  inline AMX *GetPtr() const { return amx_; }
+  static void Reset() {
+    for (auto &entry : Entries()) {
+      entry.calls = entry.errors = entry.total_ns = entry.max_ns = 0;
+    }
+  }
 
-  template <PLUGIN_AMX_EXPORT func, bool raise_error = true, typename Ret = int,
-            typename... Args>
-  inline Ret Call(Args... args) {
-    Ret result = reinterpret_cast<Ret(AMXAPI **)(Args...)>(
-        amx_functions_)[func](args...);
+  // Entries that were called at least once, the most expensive first
+  static std::vector<const CallStats *> Snapshot() {
+    std::vector<const CallStats *> result;
 
-    if constexpr (raise_error && std::is_same<int, Ret>::value) {
-      if (log_amx_errors_ && result != AMX_ERR_NONE) {
-        Log(StrError(result) + " in amx_" + StrFunction(func) + "(" +
-            DumpArgs(args...) + ")");
+    for (const auto &entry : Entries()) {
+      if (entry.calls) {
+        result.push_back(&entry);
       }
     }
 
+    std::sort(result.begin(), result.end(), [](auto lhs, auto rhs) {
+      return lhs->total_ns > rhs->total_ns;
+    });
+
     return result;
   }
 
-  inline std::string GetPublicName(int index) {
-    int len{};
-    NameLength(&len);
+ private:
+  static CallStats *Find(const std::string &name, bool is_public) {
+    if constexpr (!enabled) {
+      return nullptr;
+    }
 
-    std::unique_ptr<char[]> name{new char[len + 1]{}};
-    GetPublic(index, name.get());
+    auto &index = is_public ? PublicIndex() : NativeIndex();
+    auto iter = index.find(name);
 
-    return name.get();
+    if (iter != index.end()) {
+      return iter->second;
+    }
+
+    CallStats &entry = Entries().emplace_back();
+
+    entry.is_public = is_public;
+    entry.name = name;
+
+    return index[name] = &entry;
   }
 
-  template <typename T, typename... Args>
-  inline std::string DumpArgs(T arg1, Args... args) {
-    std::stringstream ss;
+  // deque, so the pointers handed out stay valid
+  static std::deque<CallStats> &Entries() {
+    static std::deque<CallStats> entries;
 
-    ss << AddQuotesIfStr(arg1);
-    ((ss << ", " << AddQuotesIfStr(args)), ...);
+    return entries;
+  }
 
-    return ss.str();
+  static std::unordered_map<std::string, CallStats *> &NativeIndex() {
+    static std::unordered_map<std::string, CallStats *> index;
+
+    return index;
   }
 
-  template <typename T>
-  inline auto AddQuotesIfStr(T arg) {
-    if constexpr (std::is_same<T, const char *>::value ||
-                  std::is_same<T, char *>::value) {
-      return "\"" + std::string(arg) + "\"";
-    } else if constexpr (std::is_same<typename std::decay<T>::type,
-                                      std::string>::value) {
-      return "\"" + arg + "\"";
-    } else {
-      return arg;
-    }
+  static std::unordered_map<std::string, CallStats *> &PublicIndex() {
+    static std::unordered_map<std::string, CallStats *> index;
+
+    return index;
   }
+};
 
-  inline const std::string StrFunction(PLUGIN_AMX_EXPORT func) {
+// Measures one call for as long as it is in scope
+class CallTimer {
+ public:
+#ifdef PTL_ENABLE_STATS
+  explicit CallTimer(CallStats *stats)
+      : stats_{stats}, start_{std::chrono::steady_clock::now()} {}
+
+  ~CallTimer() {
+    if (!stats_) {
+      return;
+    }
+
+    auto ns = static_cast<std::uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start_)
+            .count());
+
+    ++stats_->calls;
+    stats_->total_ns += ns;
+    stats_->max_ns = std::max(stats_->max_ns, ns);
+  }
+
+  inline void Fail() {
+    if (stats_) {
+      ++stats_->errors;
+    }
+  }
+
+ private:
+  CallStats *stats_{};
+  std::chrono::steady_clock::time_point start_;
+#else
+  explicit CallTimer(CallStats *) {}
+
+  inline void Fail() {}
+#endif
+};
+
+// Log-linear latency histogram in the spirit of HdrHistogram: 16 linear
+// sub-buckets per power of two, so every value is kept within ~6%
+class LatencyHistogram {
+ public:
+  static constexpr int sub_bucket_bits = 4;
+  static constexpr int max_bits = 40;  // larger values are clamped
+
+  inline void Record(std::uint64_t value) {
+    value = std::min(value, max_value);
+
+    ++counts_[BucketIndex(value)];
+    ++count_;
+    max_ = std::max(max_, value);
+  }
+
+  // Highest value of the bucket holding the given percentile (0-100)
+  std::uint64_t Percentile(double percentile) const {
+    if (!count_) {
+      return 0;
+    }
+
+    auto rank = static_cast<std::uint64_t>(percentile / 100.0 * count_);
+    std::uint64_t seen{};
+
+    for (std::size_t i = 0; i < bucket_count; ++i) {
+      seen += counts_[i];
+
+      if (seen > rank || seen == count_) {
+        return std::min(BucketHighest(i), max_);
+      }
+    }
+
+    return max_;
+  }
+
+  inline std::uint64_t Count() const { return count_; }
+
+  inline std::uint64_t Max() const { return max_; }
+
+  void Reset() {
+    counts_.fill(0);
+    count_ = 0;
+    max_ = 0;
+  }
+
+ private:
+  static constexpr std::uint64_t sub_buckets = 1 << sub_bucket_bits;
+  static constexpr std::uint64_t max_value = (1ull << max_bits) - 1;
+  static constexpr std::size_t bucket_count =
+      (max_bits - sub_bucket_bits + 1) * sub_buckets;
+
+  // Values below 2 * sub_buckets get a bucket each, then every power of two
+  // is split into sub_buckets equal parts
+  static inline std::size_t BucketIndex(std::uint64_t value) {
+    if (value < 2 * sub_buckets) {
+      return static_cast<std::size_t>(value);
+    }
+
+    int shift = HighestBit(value) - sub_bucket_bits;
+
+    return static_cast<std::size_t>(shift * sub_buckets + (value >> shift));
+  }
+
+  static inline std::uint64_t BucketHighest(std::size_t index) {
+    if (index < 2 * sub_buckets) {
+      return index;
+    }
+
+    int shift = static_cast<int>(index / sub_buckets) - 1;
+    std::uint64_t mantissa = index % sub_buckets + sub_buckets;
+
+    return ((mantissa + 1) << shift) - 1;
+  }
+
+  static inline int HighestBit(std::uint64_t value) {
+#ifdef _MSC_VER
+    unsigned long index{};
+    auto high = static_cast<unsigned long>(value >> 32);
+
+    if (high) {
+      _BitScanReverse(&index, high);
+
+      return static_cast<int>(index) + 32;
+    }
+
+    _BitScanReverse(&index, static_cast<unsigned long>(value));
+
+    return static_cast<int>(index);
+#else
+    return 63 - __builtin_clzll(value);
+#endif
+  }
+
+  std::array<std::uint32_t, bucket_count> counts_{};
+  std::uint64_t count_{};
+  std::uint64_t max_{};
+};
+
+// Measures OnProcessTick. Timestamps come from the TSC on x86 (a few ns to
+// read, calibrated against steady_clock), steady_clock elsewhere. Durations
+// are kept in clock ticks and converted only when reported
+class TickProfiler {
+ public:
+  // steady_clock time the first TSC rate estimate is taken over
+  static constexpr double calibration_ns = 10e6;
+
+  static inline std::uint64_t Now() {
+#ifdef PTL_X86
+    return __rdtsc();
+#else
+    return static_cast<std::uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch())
+            .count());
+#endif
+  }
+
+  // budget_us: ticks longer than this are counted and logged once a second,
+  // summary_seconds: how often the percentiles are logged (0 - never)
+  void Start(int budget_us, int summary_seconds) {
+    budget_us_ = budget_us;
+    summary_seconds_ = summary_seconds;
+
+    start_ = Now();
+    start_time_ = std::chrono::steady_clock::now();
+
+    calibrated_ = false;
+    budget_ticks_ = static_cast<std::uint64_t>(-1);
+    next_report_ = static_cast<std::uint64_t>(-1);
+    next_summary_ = static_cast<std::uint64_t>(-1);
+
+    histogram_.Reset();
+    overruns_ = 0;
+    worst_overrun_ = 0;
+
+    Calibrate(start_);
+  }
+
+  // Returns true if Report should be called
+  inline bool Record(std::uint64_t start, std::uint64_t end) {
+    if (!calibrated_) {
+      Calibrate(end);
+    }
+
+    std::uint64_t duration = end - start;
+
+    histogram_.Record(duration);
+
+    if (duration > budget_ticks_) {
+      ++overruns_;
+      worst_overrun_ = std::max(worst_overrun_, duration);
+    }
+
+    return end >= next_report_;
+  }
+
+  template <typename LogFunc>
+  void Report(std::uint64_t now, LogFunc &&log) {
+    Calibrate(now);
+
+    if (overruns_) {
+      log("%llu tick(s) over the %dus budget, worst %.1fus",
+          static_cast<unsigned long long>(overruns_), budget_us_,
+          Microseconds(worst_overrun_));
+
+      overruns_ = 0;
+      worst_overrun_ = 0;
+    }
+
+    if (now >= next_summary_) {
+      log("ticks: %llu, p50 %.1fus, p99 %.1fus, p99.9 %.1fus, max %.1fus",
+          static_cast<unsigned long long>(histogram_.Count()),
+          Microseconds(histogram_.Percentile(50)),
+          Microseconds(histogram_.Percentile(99)),
+          Microseconds(histogram_.Percentile(99.9)),
+          Microseconds(histogram_.Max()));
+
+      histogram_.Reset();
+      next_summary_ = now + Ticks(summary_seconds_ * 1e9);
+    }
+
+    next_report_ = now + Ticks(1e9);
+  }
+
+  // Ticks recorded since the last summary
+  inline const LatencyHistogram &Histogram() const { return histogram_; }
+
+  inline double Microseconds(std::uint64_t ticks) const {
+    return ticks * ns_per_tick_ / 1e3;
+  }
+
+ private:
+  inline std::uint64_t Ticks(double ns) const {
+    return static_cast<std::uint64_t>(ns / ns_per_tick_);
+  }
+
+  // The TSC rate is the steady_clock time since Start over the TSC delta,
+  // first estimated once calibration_ns have passed (so Start never waits)
+  // and refined on every report. Until then ticks are recorded, but not
+  // checked against the budget
+  void Calibrate(std::uint64_t now) {
+#ifdef PTL_X86
+    double elapsed_ns = static_cast<double>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start_time_)
+            .count());
+
+    if (now <= start_ || elapsed_ns < (calibrated_ ? 1 : calibration_ns)) {
+      return;
+    }
+
+    ns_per_tick_ = elapsed_ns / (now - start_);
+#endif
+
+    budget_ticks_ = budget_us_ ? Ticks(budget_us_ * 1e3)
+                               : static_cast<std::uint64_t>(-1);
+
+    if (!calibrated_) {
+      calibrated_ = true;
+
+      next_report_ = start_ + Ticks(1e9);
+      next_summary_ = summary_seconds_
+                          ? start_ + Ticks(summary_seconds_ * 1e9)
+                          : static_cast<std::uint64_t>(-1);
+    }
+  }
+
+  LatencyHistogram histogram_;
+  double ns_per_tick_{1.0};
+  bool calibrated_{};
+  std::uint64_t start_{};
+  std::chrono::steady_clock::time_point start_time_;
+  int budget_us_{};
+  int summary_seconds_{};
+  std::uint64_t budget_ticks_{static_cast<std::uint64_t>(-1)};
+  std::uint64_t next_report_{};
+  std::uint64_t next_summary_{};
+  std::uint64_t overruns_{};
+  std::uint64_t worst_overrun_{};
+};
+
+// Fixed set of worker threads. Work runs on a worker and returns a
+// completion, which goes through a lock-free MPSC queue (Vyukov) and is
+// called on the server thread by Drain
+class TaskPool {
+ public:
+  using Completion = std::function<void()>;
+  using Work = std::function<Completion()>;
+
+  TaskPool() = default;
+  TaskPool(const TaskPool &) = delete;
+  TaskPool &operator=(const TaskPool &) = delete;
+
+  ~TaskPool() { Stop(); }
+
+  // Takes effect on the next start; threads are started by the first Submit
+  inline void SetThreads(std::size_t threads) {
+    threads_ = std::max<std::size_t>(threads, 1);
+  }
+
+  // Server thread only
+  void Submit(Work work) {
+    if (workers_.empty()) {
+      for (std::size_t i = 0; i < threads_; ++i) {
+        workers_.emplace_back([this] { Run(); });
+      }
+    }
+
+    {
+      std::lock_guard<std::mutex> lock{mutex_};
+
+      jobs_.push_back(std::move(work));
+    }
+
+    jobs_cv_.notify_one();
+  }
+
+  // Server thread only. Calls every queued completion, the message of any
+  // exception is passed to on_error
+  template <typename ErrorFunc>
+  std::size_t Drain(ErrorFunc &&on_error) {
+    std::size_t count{};
+
+    while (Node *node = Pop()) {
+      std::unique_ptr<Node> owned{node};
+
+      try {
+        node->completion();
+      } catch (const std::exception &e) {
+        on_error(e.what());
+      } catch (...) {
+        on_error("unknown exception");
+      }
+
+      ++count;
+    }
+
+    return count;
+  }
+
+  // Joins the workers. Queued work and completions are dropped
+  void Stop() {
+    {
+      std::lock_guard<std::mutex> lock{mutex_};
+
+      stopping_ = true;
+      jobs_.clear();
+    }
+
+    jobs_cv_.notify_all();
+
+    for (auto &worker : workers_) {
+      worker.join();
+    }
+
+    workers_.clear();
+
+    while (Node *node = Pop()) {
+      delete node;
+    }
+
+    stopping_ = false;
+  }
+
+ private:
+  struct Node {
+    std::atomic<Node *> next{};
+    Completion completion;
+  };
+
+  void Run() {
+    for (;;) {
+      Work work;
+
+      {
+        std::unique_lock<std::mutex> lock{mutex_};
+
+        jobs_cv_.wait(lock, [this] { return stopping_ || !jobs_.empty(); });
+
+        if (stopping_) {
+          return;
+        }
+
+        work = std::move(jobs_.front());
+        jobs_.pop_front();
+      }
+
+      Completion completion;
+
+      // Errors are reported on the server thread, logprintf is not
+      // thread-safe
+      try {
+        completion = work();
+      } catch (const std::exception &e) {
+        completion = [error = std::string{e.what()}] {
+          throw std::runtime_error{error};
+        };
+      } catch (...) {
+        completion = [] { throw std::runtime_error{"unknown exception"}; };
+      }
+
+      if (completion) {
+        Push(new Node{{}, std::move(completion)});
+      }
+    }
+  }
+
+  // Any thread
+  inline void Push(Node *node) {
+    Node *prev = head_.exchange(node, std::memory_order_acq_rel);
+
+    prev->next.store(node, std::memory_order_release);
+  }
+
+  // Server thread only. Null if the queue is empty or a push is in progress
+  Node *Pop() {
+    Node *tail = tail_;
+    Node *next = tail->next.load(std::memory_order_acquire);
+
+    if (tail == &stub_) {
+      if (!next) {
+        return nullptr;
+      }
+
+      tail_ = next;
+      tail = next;
+      next = next->next.load(std::memory_order_acquire);
+    }
+
+    if (next) {
+      tail_ = next;
+
+      return tail;
+    }
+
+    if (tail != head_.load(std::memory_order_acquire)) {
+      return nullptr;
+    }
+
+    // tail is the last node, the stub goes behind it so it can be taken
+    stub_.next.store(nullptr, std::memory_order_relaxed);
+    Push(&stub_);
+
+    next = tail->next.load(std::memory_order_acquire);
+
+    if (next) {
+      tail_ = next;
+
+      return tail;
+    }
+
+    return nullptr;
+  }
+
+  std::size_t threads_{1};
+  std::vector<std::thread> workers_;
+
+  std::mutex mutex_;
+  std::condition_variable jobs_cv_;
+  std::deque<Work> jobs_;
+  bool stopping_{};
+
+  Node stub_;
+  std::atomic<Node *> head_{&stub_};
+  Node *tail_{&stub_};
+};
+
+// Compile-time checked printf format strings, created by PTL_FMT("...").
+// Log(PTL_FMT("%s: %d"), name, value) fails to compile if the specifiers
+// don't match the arguments. std::string arguments are accepted for %s
+struct FormatString {};
+
+template <typename T>
+struct IsFormatString : std::is_base_of<FormatString, T> {};
+
+enum class FormatError {
+  kNone,
+  kTooFewArgs,
+  kTooManyArgs,
+  kTypeMismatch,
+  kBadSpecifier
+};
+
+struct FormatArgInfo {
+  enum class Kind { kNone, kInteger, kFloating, kString, kPointer, kOther };
+
+  Kind kind;
+  std::size_t size;
+};
+
+template <typename T>
+constexpr FormatArgInfo GetFormatArgInfo() {
+  using Kind = FormatArgInfo::Kind;
+  using Arg = std::decay_t<T>;
+
+  if constexpr (std::is_same<Arg, std::string>::value ||
+                std::is_same<Arg, const char *>::value ||
+                std::is_same<Arg, char *>::value) {
+    return {Kind::kString, sizeof(Arg)};
+  } else if constexpr (std::is_integral<Arg>::value ||
+                       std::is_enum<Arg>::value) {
+    return {Kind::kInteger, sizeof(Arg)};
+  } else if constexpr (std::is_floating_point<Arg>::value) {
+    return {Kind::kFloating, sizeof(Arg)};
+  } else if constexpr (std::is_pointer<Arg>::value) {
+    return {Kind::kPointer, sizeof(Arg)};
+  } else {
+    return {Kind::kOther, sizeof(Arg)};
+  }
+}
+
+// Integers of up to int size are promoted, longer ones need a length
+constexpr bool FormatIntegerLengthMatches(char length, bool doubled,
+                                          std::size_t size) {
+  switch (length) {
+    case '\0':
+    case 'h':
+      return size <= sizeof(int);
+    case 'l':
+      return size == (doubled ? sizeof(long long) : sizeof(long));
+    case 'z':
+      return size == sizeof(std::size_t);
+    case 'j':
+      return size == sizeof(std::intmax_t);
+    case 't':
+      return size == sizeof(std::ptrdiff_t);
+    default:
+      return false;
+  }
+}
+
+constexpr bool IsFormatDigit(char c) { return c >= '0' && c <= '9'; }
+
+constexpr FormatError CheckFormat(const char *fmt, const FormatArgInfo *args,
+                                  std::size_t count) {
+  using Kind = FormatArgInfo::Kind;
+
+  std::size_t arg{};
+
+  for (std::size_t i = 0; fmt[i]; ++i) {
+    if (fmt[i] != '%') {
+      continue;
+    }
+
+    if (fmt[++i] == '%') {
+      continue;
+    }
+
+    while (fmt[i] == '-' || fmt[i] == '+' || fmt[i] == ' ' || fmt[i] == '#' ||
+           fmt[i] == '0') {
+      ++i;
+    }
+
+    // Width, then precision; '*' takes an int argument
+    for (int part = 0; part < 2; ++part) {
+      if (part == 1) {
+        if (fmt[i] != '.') {
+          break;
+        }
+
+        ++i;
+      }
+
+      if (fmt[i] == '*') {
+        if (arg >= count) {
+          return FormatError::kTooFewArgs;
+        }
+
+        if (args[arg].kind != Kind::kInteger ||
+            args[arg].size > sizeof(int)) {
+          return FormatError::kTypeMismatch;
+        }
+
+        ++arg;
+        ++i;
+      } else {
+        while (IsFormatDigit(fmt[i])) {
+          ++i;
+        }
+      }
+    }
+
+    char length{};
+    bool doubled{};
+
+    if (fmt[i] == 'h' || fmt[i] == 'l' || fmt[i] == 'L' || fmt[i] == 'z' ||
+        fmt[i] == 'j' || fmt[i] == 't') {
+      length = fmt[i++];
+
+      if ((length == 'h' || length == 'l') && fmt[i] == length) {
+        doubled = true;
+        ++i;
+      }
+    }
+
+    char conversion = fmt[i];
+
+    if (!conversion) {
+      return FormatError::kBadSpecifier;
+    }
+
+    if (arg >= count) {
+      return FormatError::kTooFewArgs;
+    }
+
+    const FormatArgInfo &info = args[arg++];
+
+    switch (conversion) {
+      case 'd':
+      case 'i':
+      case 'u':
+      case 'o':
+      case 'x':
+      case 'X':
+      case 'c':
+        if (info.kind != Kind::kInteger ||
+            !FormatIntegerLengthMatches(length, doubled, info.size)) {
+          return FormatError::kTypeMismatch;
+        }
+
+        break;
+      case 'f':
+      case 'F':
+      case 'e':
+      case 'E':
+      case 'g':
+      case 'G':
+      case 'a':
+      case 'A':
+        if (info.kind != Kind::kFloating ||
+            (length == 'L') != (info.size == sizeof(long double) &&
+                                sizeof(long double) != sizeof(double))) {
+          return FormatError::kTypeMismatch;
+        }
+
+        break;
+      case 's':
+        if (info.kind != Kind::kString || length) {
+          return FormatError::kTypeMismatch;
+        }
+
+        break;
+      case 'p':
+        if (info.kind != Kind::kPointer && info.kind != Kind::kString) {
+          return FormatError::kTypeMismatch;
+        }
+
+        break;
+      default:  // %n included
+        return FormatError::kBadSpecifier;
+    }
+  }
+
+  return arg == count ? FormatError::kNone : FormatError::kTooManyArgs;
+}
+
+template <typename FmtT, typename... Args>
+constexpr FormatError CheckFormat() {
+  constexpr FormatArgInfo args[] = {GetFormatArgInfo<Args>()...,
+                                    {FormatArgInfo::Kind::kNone, 0}};
+
+  return CheckFormat(FmtT::Get(), args, sizeof...(Args));
+}
+
+template <typename FmtT, typename... Args>
+constexpr void AssertFormat() {
+  constexpr FormatError error = CheckFormat<FmtT, Args...>();
+
+  static_assert(error != FormatError::kTooFewArgs,
+                "Not enough arguments for the format string");
+  static_assert(error != FormatError::kTooManyArgs,
+                "Too many arguments for the format string");
+  static_assert(error != FormatError::kTypeMismatch,
+                "Format specifier does not match the argument type");
+  static_assert(error != FormatError::kBadSpecifier,
+                "Invalid or unsupported format specifier");
+}
+
+// What actually goes through the varargs
+template <typename T>
+inline auto FormatArg(const T &arg) {
+  if constexpr (std::is_same<T, std::string>::value) {
+    return arg.c_str();
+  } else if constexpr (std::is_enum<T>::value) {
+    return static_cast<std::underlying_type_t<T>>(arg);
+  } else {
+    return arg;
+  }
+}
+
+// Log output of a plugin, "[name] " is prepended once per message. With
+// async logging, messages are formatted into a preallocated lock-free ring
+// and written by Flush on the server thread, so an error storm never
+// blocks on logprintf. Messages that don't fit in the ring are counted, the
+// ones longer than a slot are cut and end with truncated_marker
+class Logger {
+ public:
+  static constexpr std::size_t message_size = 512;
+  static constexpr char truncated_marker[] = "... [truncated]";
+  static constexpr std::size_t ring_size = 1024;  // power of two
+
+  inline void SetLogPrintf(LogPrintf logprintf) { logprintf_ = logprintf; }
+
+  inline void SetName(const std::string &name) {
+    prefix_ = name.empty() ? "" : "[" + name + "] ";
+  }
+
+  // Server thread only, while nothing else logs
+  void SetAsync(bool async) {
+    if (async && !ring_) {
+      ring_.reset(new Slot[ring_size]);
+
+      for (std::size_t i = 0; i < ring_size; ++i) {
+        ring_[i].sequence.store(i, std::memory_order_relaxed);
+      }
+    }
+
+    if (!async) {
+      Flush();
+    }
+
+    async_ = async;
+  }
+
+  inline bool IsAsync() const { return async_; }
+
+  // Any thread if async, server thread only otherwise
+  template <typename... Args>
+  void Log(const char *fmt, Args... args) {
+    if (!logprintf_) {
+      throw std::runtime_error{"logprintf_ is null"};
+    }
+
+    if (async_) {
+      std::size_t pos{};
+      Slot *slot = Acquire(pos);
+
+      if (!slot) {
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+
+        return;
+      }
+
+      if (Format(slot->text, message_size, fmt, args...) >= message_size) {
+        std::memcpy(slot->text + message_size - sizeof(truncated_marker),
+                    truncated_marker, sizeof(truncated_marker));
+      }
+
+      slot->sequence.store(pos + 1, std::memory_order_release);
+
+      return;
+    }
+
+    char buf[message_size];
+    std::size_t len = Format(buf, sizeof(buf), fmt, args...);
+
+    if (len < sizeof(buf)) {
+      logprintf_("%s", buf);
+
+      return;
+    }
+
+    std::string long_message(len + 1, '\0');
+
+    Format(long_message.data(), long_message.size(), fmt, args...);
+
+    logprintf_("%s", long_message.c_str());
+  }
+
+  template <typename FmtT, typename... Args>
+  std::enable_if_t<IsFormatString<FmtT>::value> Log(FmtT, Args... args) {
+    AssertFormat<FmtT, Args...>();
+
+    Log(FmtT::Get(), FormatArg(args)...);
+  }
+
+  // Server thread only. Writes the queued messages
+  void Flush() {
+    if (!ring_) {
+      return;
+    }
+
+    for (;; ++read_pos_) {
+      Slot &slot = ring_[read_pos_ & (ring_size - 1)];
+
+      if (slot.sequence.load(std::memory_order_acquire) != read_pos_ + 1) {
+        break;
+      }
+
+      logprintf_("%s", slot.text);
+
+      slot.sequence.store(read_pos_ + ring_size, std::memory_order_release);
+    }
+
+    if (auto dropped = dropped_.exchange(0, std::memory_order_relaxed)) {
+      logprintf_("%s%llu log message(s) dropped", prefix_.c_str(),
+                 static_cast<unsigned long long>(dropped));
+    }
+  }
+
+ private:
+  struct Slot {
+    std::atomic<std::size_t> sequence;
+    char text[message_size];
+  };
+
+  // Bounded MPMC queue of Vyukov, with the server thread as the only reader
+  inline Slot *Acquire(std::size_t &pos) {
+    pos = write_pos_.load(std::memory_order_relaxed);
+
+    for (;;) {
+      Slot &slot = ring_[pos & (ring_size - 1)];
+      auto diff = static_cast<std::ptrdiff_t>(
+          slot.sequence.load(std::memory_order_acquire) - pos);
+
+      if (diff == 0) {
+        if (write_pos_.compare_exchange_weak(pos, pos + 1,
+                                             std::memory_order_relaxed)) {
+          return &slot;
+        }
+      } else if (diff < 0) {
+        return nullptr;  // full
+      } else {
+        pos = write_pos_.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  // Returns the length of the whole message, like snprintf
+  template <typename... Args>
+  inline std::size_t Format(char *buf, std::size_t size, const char *fmt,
+                            Args... args) {
+    std::size_t prefix_len = std::min(prefix_.size(), size - 1);
+
+    std::memcpy(buf, prefix_.data(), prefix_len);
+    buf[prefix_len] = '\0';
+
+    int len = Print(buf + prefix_len, size - prefix_len, fmt, args...);
+
+    return prefix_len + (len > 0 ? static_cast<std::size_t>(len) : 0);
+  }
+
+  // printf semantics even without arguments, like logprintf
+  static int Print(char *buf, std::size_t size, const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    int len = std::vsnprintf(buf, size, fmt, args);
+    va_end(args);
+
+    return len;
+  }
+
+  LogPrintf logprintf_{};
+  std::string prefix_;
+  bool async_{};
+
+  std::unique_ptr<Slot[]> ring_;
+  std::atomic<std::size_t> write_pos_{};
+  std::size_t read_pos_{};
+  std::atomic<std::uint64_t> dropped_{};
+};
+
+class Amx {
+ public:
+  // error_log_rate: max messages a second per (function or public, error),
+  // 0 - unlimited
+  Amx(AMX *amx, const AmxApi &api, bool log_amx_errors, int error_log_rate,
+      Logger &logger)
+      : amx_{amx},
+        api_{&api},
+        logger_{&logger},
+        log_amx_errors_{log_amx_errors},
+        error_log_rate_{error_log_rate} {}
+
+  uint16_t *Align16(uint16_t *v) {
+    return Invoke<PLUGIN_AMX_EXPORT_Align16, false>(api_->Align16, v);
+  }
+
+  uint32_t *Align32(uint32_t *v) {
+    return Invoke<PLUGIN_AMX_EXPORT_Align32, false>(api_->Align32, v);
+  }
+
+#if defined _I64_MAX || defined HAVE_I64
+  uint64_t *Align64(uint64_t *v) {
+    return Invoke<PLUGIN_AMX_EXPORT_Align64, false>(api_->Align64, v);
+  }
+#endif
+
+  template <bool raise_error = true>
+  int Allot(int cells, cell *amx_addr, cell **phys_addr) {
+    return Invoke<PLUGIN_AMX_EXPORT_Allot, raise_error>(api_->Allot, amx_,
+                                                        cells, amx_addr,
+                                                        phys_addr);
+  }
+
+  template <bool raise_error = true>
+  int Callback(cell index, cell *result, cell *params) {
+    return Invoke<PLUGIN_AMX_EXPORT_Callback, raise_error>(api_->Callback, amx_,
+                                                           index, result,
+                                                           params);
+  }
+
+  template <bool raise_error = true>
+  int Cleanup() {
+    return Invoke<PLUGIN_AMX_EXPORT_Cleanup, raise_error>(api_->Cleanup, amx_);
+  }
+
+  template <bool raise_error = true>
+  int Clone(AMX *amx_clone, void *data) {
+    return Invoke<PLUGIN_AMX_EXPORT_Clone, raise_error>(api_->Clone, amx_clone,
+                                                        amx_, data);
+  }
+
+  template <bool raise_error = true>
+  int Exec(cell *retval, int index, const std::string &debug_args_values = "") {
+    return Exec<raise_error>(
+        retval, index, [&debug_args_values] { return debug_args_values; });
+  }
+
+  // dump_args is only invoked when an error is about to be logged, so the
+  // arguments are never formatted on the successful path
+  template <bool raise_error = true, typename DumpArgsFunc,
+            typename = std::enable_if_t<std::is_invocable_r_v<
+                std::string, DumpArgsFunc>>>
+  int Exec(cell *retval, int index, DumpArgsFunc &&dump_args) {
+    int result = Invoke<PLUGIN_AMX_EXPORT_Exec, false>(api_->Exec, amx_, retval,
+                                                       index);
+
+    if constexpr (raise_error) {
+      std::uint64_t suppressed{};
+
+      if (log_amx_errors_ && result != AMX_ERR_NONE &&
+          AllowErrorLog(ErrorSite::kPublic, index, result, suppressed)) {
+        Log(PTL_FMT("%s%s"),
+            (StrError(result) + " in public " + PublicNameForLog(index) + "(" +
+             dump_args() +
+             ") - please note that the AMX error is not related with the "
+             "plugin, but your script")
+                .c_str(),
+            SuppressedNote(suppressed).c_str());
+      }
+    }
+
+    return result;
+  }
+
+  template <bool raise_error = true>
+  int FindNative(const char *name, int *index) {
+    return Invoke<PLUGIN_AMX_EXPORT_FindNative, raise_error>(api_->FindNative,
+                                                             amx_, name, index);
+  }
+
+  template <bool raise_error = true>
+  int FindPublic(const char *funcname, int *index) {
+    return Invoke<PLUGIN_AMX_EXPORT_FindPublic, raise_error>(api_->FindPublic,
+                                                             amx_, funcname,
+                                                             index);
+  }
+
+  template <bool raise_error = true>
+  int FindPubVar(const char *varname, cell *amx_addr) {
+    return Invoke<PLUGIN_AMX_EXPORT_FindPubVar, raise_error>(api_->FindPubVar,
+                                                             amx_, varname,
+                                                             amx_addr);
+  }
+
+  template <bool raise_error = true>
+  int FindTagId(cell tag_id, char *tagname) {
+    return Invoke<PLUGIN_AMX_EXPORT_FindTagId, raise_error>(api_->FindTagId,
+                                                            amx_, tag_id,
+                                                            tagname);
+  }
+
+  template <bool raise_error = true>
+  int Flags(uint16_t *flags) {
+    return Invoke<PLUGIN_AMX_EXPORT_Flags, raise_error>(api_->Flags, amx_,
+                                                        flags);
+  }
+
+  // Same as amx_GetAddr, without the indirect call if inline_calls is set
+  template <bool raise_error = true>
+  inline int GetAddr(cell amx_addr, cell **phys_addr) {
+    if (!api_->inline_calls) {
+      return Invoke<PLUGIN_AMX_EXPORT_GetAddr, raise_error>(
+          api_->GetAddr, amx_, amx_addr, phys_addr);
+    }
+
+    int result = AMX_ERR_NONE;
+
+    if ((amx_addr >= amx_->hea && amx_addr < amx_->stk) || amx_addr < 0 ||
+        amx_addr >= amx_->stp) {
+      result = AMX_ERR_MEMACCESS;
+      *phys_addr = nullptr;
+    } else {
+      *phys_addr = reinterpret_cast<cell *>(GetData() + amx_addr);
+    }
+
+    if constexpr (raise_error) {
+      if (result != AMX_ERR_NONE) {
+        LogCallError(PLUGIN_AMX_EXPORT_GetAddr, result, amx_, amx_addr,
+                     phys_addr);
+      }
+    }
+
+    return result;
+  }
+
+  template <bool raise_error = true>
+  int GetNative(int index, char *funcname) {
+    return Invoke<PLUGIN_AMX_EXPORT_GetNative, raise_error>(api_->GetNative,
+                                                            amx_, index,
+                                                            funcname);
+  }
+
+  template <bool raise_error = true>
+  int GetPublic(int index, char *funcname) {
+    return Invoke<PLUGIN_AMX_EXPORT_GetPublic, raise_error>(api_->GetPublic,
+                                                            amx_, index,
+                                                            funcname);
+  }
+
+  template <bool raise_error = true>
+  int GetPubVar(int index, char *varname, cell *amx_addr) {
+    return Invoke<PLUGIN_AMX_EXPORT_GetPubVar, raise_error>(api_->GetPubVar,
+                                                            amx_, index,
+                                                            varname, amx_addr);
+  }
+
+  template <bool raise_error = true>
+  int GetString(char *dest, const cell *source, int use_wchar,
+                std::size_t size) {
+    return Invoke<PLUGIN_AMX_EXPORT_GetString, raise_error>(api_->GetString,
+                                                            dest, source,
+                                                            use_wchar, size);
+  }
+
+  template <bool raise_error = true>
+  int GetTag(int index, char *tagname, cell *tag_id) {
+    return Invoke<PLUGIN_AMX_EXPORT_GetTag, raise_error>(api_->GetTag, amx_,
+                                                         index, tagname,
+                                                         tag_id);
+  }
+
+  template <bool raise_error = true>
+  int GetUserData(long tag, void **ptr) {
+    return Invoke<PLUGIN_AMX_EXPORT_GetUserData, raise_error>(api_->GetUserData,
+                                                              amx_, tag, ptr);
+  }
+
+  template <bool raise_error = true>
+  int Init(void *program) {
+    return Invoke<PLUGIN_AMX_EXPORT_Init, raise_error>(api_->Init, amx_,
+                                                       program);
+  }
+
+  template <bool raise_error = true>
+  int InitJIT(void *reloc_table, void *native_code) {
+    return Invoke<PLUGIN_AMX_EXPORT_InitJIT, raise_error>(api_->InitJIT, amx_,
+                                                          reloc_table,
+                                                          native_code);
+  }
+
+  template <bool raise_error = true>
+  int MemInfo(long *codesize, long *datasize, long *stackheap) {
+    return Invoke<PLUGIN_AMX_EXPORT_MemInfo, raise_error>(api_->MemInfo, amx_,
+                                                          codesize, datasize,
+                                                          stackheap);
+  }
+
+  template <bool raise_error = true>
+  int NameLength(int *length) {
+    return Invoke<PLUGIN_AMX_EXPORT_NameLength, raise_error>(api_->NameLength,
+                                                             amx_, length);
+  }
+
+  AMX_NATIVE_INFO *NativeInfo(const char *name, AMX_NATIVE func) {
+    return Invoke<PLUGIN_AMX_EXPORT_NativeInfo, false>(api_->NativeInfo, name,
+                                                       func);
+  }
+
+  template <bool raise_error = true>
+  int NumNatives(int *number) {
+    return Invoke<PLUGIN_AMX_EXPORT_NumNatives, raise_error>(api_->NumNatives,
+                                                             amx_, number);
+  }
+
+  template <bool raise_error = true>
+  int NumPublics(int *number) {
+    return Invoke<PLUGIN_AMX_EXPORT_NumPublics, raise_error>(api_->NumPublics,
+                                                             amx_, number);
+  }
+
+  template <bool raise_error = true>
+  int NumPubVars(int *number) {
+    return Invoke<PLUGIN_AMX_EXPORT_NumPubVars, raise_error>(api_->NumPubVars,
+                                                             amx_, number);
+  }
+
+  template <bool raise_error = true>
+  int NumTags(int *number) {
+    return Invoke<PLUGIN_AMX_EXPORT_NumTags, raise_error>(api_->NumTags, amx_,
+                                                          number);
+  }
+
+  // Same as amx_Push, without the indirect call if inline_calls is set
+  template <bool raise_error = true>
+  inline int Push(cell value) {
+    if (!api_->inline_calls) {
+      return Invoke<PLUGIN_AMX_EXPORT_Push, raise_error>(api_->Push, amx_,
+                                                         value);
+    }
+
+    int result = AMX_ERR_NONE;
+
+    if (amx_->hea + stack_margin > amx_->stk) {
+      result = AMX_ERR_STACKERR;
+    } else {
+      amx_->stk -= sizeof(cell);
+      amx_->paramcount += 1;
+
+      *reinterpret_cast<cell *>(GetData() + amx_->stk) = value;
+    }
+
+    if constexpr (raise_error) {
+      if (result != AMX_ERR_NONE) {
+        LogCallError(PLUGIN_AMX_EXPORT_Push, result, amx_, value);
+      }
+    }
+
+    return result;
+  }
+
+  template <bool raise_error = true>
+  int PushArray(cell *amx_addr, cell **phys_addr, const cell array[],
+                int numcells) {
+    return Invoke<PLUGIN_AMX_EXPORT_PushArray, raise_error>(api_->PushArray,
+                                                            amx_, amx_addr,
+                                                            phys_addr, array,
+                                                            numcells);
+  }
+
+  template <bool raise_error = true>
+  int PushString(cell *amx_addr, cell **phys_addr, const char *string, int pack,
+                 int use_wchar) {
+    return Invoke<PLUGIN_AMX_EXPORT_PushString, raise_error>(api_->PushString,
+                                                             amx_, amx_addr,
+                                                             phys_addr, string,
+                                                             pack, use_wchar);
+  }
+
+  template <bool raise_error = true>
+  int RaiseError(int error) {
+    return Invoke<PLUGIN_AMX_EXPORT_RaiseError, raise_error>(api_->RaiseError,
+                                                             amx_, error);
+  }
+
+  template <bool raise_error = true>
+  int Register(const AMX_NATIVE_INFO *nativelist, int number) {
+    return Invoke<PLUGIN_AMX_EXPORT_Register, raise_error>(api_->Register, amx_,
+                                                           nativelist, number);
+  }
+
+  // Same as amx_Release, without the indirect call if inline_calls is set.
+  // amx_Release never fails, so only the exported one can raise an error
+  template <bool raise_error = true>
+  inline int Release(cell amx_addr) {
+    if (!api_->inline_calls) {
+      return Invoke<PLUGIN_AMX_EXPORT_Release, raise_error>(api_->Release,
+                                                            amx_, amx_addr);
+    }
+
+    if (amx_->hea > amx_addr) {
+      amx_->hea = amx_addr;
+    }
+
+    return AMX_ERR_NONE;
+  }
+
+  template <bool raise_error = true>
+  int SetCallback(AMX_CALLBACK callback) {
+    return Invoke<PLUGIN_AMX_EXPORT_SetCallback, raise_error>(api_->SetCallback,
+                                                              amx_, callback);
+  }
+
+  template <bool raise_error = true>
+  int SetDebugHook(AMX_DEBUG debug) {
+    return Invoke<PLUGIN_AMX_EXPORT_SetDebugHook, raise_error>(
+        api_->SetDebugHook, amx_, debug);
+  }
+
+  template <bool raise_error = true>
+  int SetString(cell *dest, const char *source, int pack, int use_wchar,
+                std::size_t size) {
+    return Invoke<PLUGIN_AMX_EXPORT_SetString, raise_error>(api_->SetString,
+                                                            dest, source, pack,
+                                                            use_wchar, size);
+  }
+
+  template <bool raise_error = true>
+  int SetUserData(long tag, void *ptr) {
+    return Invoke<PLUGIN_AMX_EXPORT_SetUserData, raise_error>(api_->SetUserData,
+                                                              amx_, tag, ptr);
+  }
+
+  // Same as amx_StrLen, without the indirect call if inline_calls is set
+  template <bool raise_error = true>
+  inline int StrLen(const cell *cstring, int *length) {
+    if (!api_->inline_calls) {
+      return Invoke<PLUGIN_AMX_EXPORT_StrLen, raise_error>(api_->StrLen,
+                                                           cstring, length);
+    }
+
+    if (!cstring) {
+      *length = 0;
+
+      if constexpr (raise_error) {
+        LogCallError(PLUGIN_AMX_EXPORT_StrLen, AMX_ERR_PARAMS, cstring,
+                     length);
+      }
+
+      return AMX_ERR_PARAMS;
+    }
+
+    *length = static_cast<int>(StringKernels::Length(cstring));
+
+    return AMX_ERR_NONE;
+  }
+
+  template <bool raise_error = true>
+  int UTF8Check(const char *string, int *length) {
+    return Invoke<PLUGIN_AMX_EXPORT_UTF8Check, raise_error>(api_->UTF8Check,
+                                                            string, length);
+  }
+
+  template <bool raise_error = true>
+  int UTF8Get(const char *string, const char **endptr, cell *value) {
+    return Invoke<PLUGIN_AMX_EXPORT_UTF8Get, raise_error>(api_->UTF8Get, string,
+                                                          endptr, value);
+  }
+
+  template <bool raise_error = true>
+  int UTF8Len(const cell *cstr, int *length) {
+    return Invoke<PLUGIN_AMX_EXPORT_UTF8Len, raise_error>(api_->UTF8Len, cstr,
+                                                          length);
+  }
+
+  template <bool raise_error = true>
+  int UTF8Put(char *string, char **endptr, int maxchars, cell value) {
+    return Invoke<PLUGIN_AMX_EXPORT_UTF8Put, raise_error>(api_->UTF8Put, string,
+                                                          endptr, maxchars,
+                                                          value);
+  }
+
+  inline AMX *GetPtr() const { return amx_; }
+
+  inline const AmxApi &GetApi() const { return *api_; }
+
+  // Start of the data segment, the base of every AMX address
+  inline unsigned char *GetData() const {
+    return amx_->data ? amx_->data
+                      : amx_->base + reinterpret_cast<AMX_HEADER *>(amx_->base)
+                                         ->dat;
+  }
+
+  // Called when the script is unloaded: everything cached against this AMX
+  // (public indices, addresses) must not be used anymore
+  inline void Invalidate() {
+    valid_ = false;
+
+    LogSuppressedErrors();
+  }
+
+  // Logs how many messages are still held back by the error rate limit
+  void LogSuppressedErrors() {
+    for (auto &[key, bucket] : error_buckets_) {
+      if (bucket.suppressed) {
+        Log(PTL_FMT("%s: %llu repeat(s) suppressed"), bucket.what.c_str(),
+            static_cast<unsigned long long>(bucket.suppressed));
+
+        bucket.suppressed = 0;
+      }
+    }
+  }
+
+  inline bool IsValid() const { return valid_; }
+
+  template <PLUGIN_AMX_EXPORT func, bool raise_error = true, typename Ret = int,
+            typename... Args>
+  inline Ret Call(Args... args) {
+    Ret result = reinterpret_cast<Ret(AMXAPI **)(Args...)>(api_->table)[func](
+        args...);
+
+    if constexpr (raise_error && std::is_same<int, Ret>::value) {
+      if (result != AMX_ERR_NONE) {
+        LogCallError(func, result, args...);
+      }
+    }
+
+    return result;
+  }
+
+  // Calls a typed function from the AmxApi table
+  template <PLUGIN_AMX_EXPORT func, bool raise_error = true, typename Ret,
+            typename... FuncArgs, typename... Args>
+  inline Ret Invoke(Ret(AMXAPI *function)(FuncArgs...), Args... args) {
+    Ret result = function(args...);
+
+    if constexpr (raise_error && std::is_same<int, Ret>::value) {
+      if (result != AMX_ERR_NONE) {
+        LogCallError(func, result, args...);
+      }
+    }
+
+    return result;
+  }
+
+  template <typename... Args>
+  inline void LogCallError(PLUGIN_AMX_EXPORT func, int result, Args... args) {
+    std::uint64_t suppressed{};
+
+    if (log_amx_errors_ &&
+        AllowErrorLog(ErrorSite::kFunction, func, result, suppressed)) {
+      Log(PTL_FMT("%s%s"),
+          (StrError(result) + " in amx_" + StrFunction(func) + "(" +
+           DumpArgs(args...) + ")")
+              .c_str(),
+          SuppressedNote(suppressed).c_str());
+    }
+  }
+
+  inline std::string GetPublicName(int index) {
+    int len{};
+    NameLength(&len);
+
+    std::unique_ptr<char[]> name{new char[len + 1]{}};
+    GetPublic(index, name.get());
+
+    return name.get();
+  }
+
+  inline std::string DumpArgs() { return {}; }
+
+  template <typename T, typename... Args>
+  inline std::string DumpArgs(T arg1, Args... args) {
+    std::stringstream ss;
+
+    ss << AddQuotesIfStr(arg1);
+    ((ss << ", " << AddQuotesIfStr(args)), ...);
+
+    return ss.str();
+  }
+
+  template <typename T>
+  inline auto AddQuotesIfStr(T arg) {
+    if constexpr (std::is_same<T, const char *>::value ||
+                  std::is_same<T, char *>::value) {
+      return "\"" + std::string(arg) + "\"";
+    } else if constexpr (std::is_same<typename std::decay<T>::type,
+                                      std::string>::value) {
+      return "\"" + arg + "\"";
+    } else {
+      return arg;
+    }
+  }
+
+  inline const std::string StrFunction(PLUGIN_AMX_EXPORT func) {
     static const std::string functions[] = {
         "Align16",      "Align32",    "Align64",     "Allot",
         "Callback",     "Cleanup",    "Clone",       "Exec",
@@ -369,159 +2090,1046 @@ class Amx {
         "UTF8Check",    "UTF8Get",    "UTF8Len",     "UTF8Put",
     };
 
-    if (func < 0 || func >= (sizeof(functions) / sizeof(functions[0]))) {
-      return "(unknown function, " + std::to_string(func) + ")";
+    if (func < 0 || func >= (sizeof(functions) / sizeof(functions[0]))) {
+      return "(unknown function, " + std::to_string(func) + ")";
+    }
+
+    return functions[func];
+  }
+
+  inline const std::string StrError(int errnum) {
+    static const std::string messages[] = {
+        "(none)",                                          // AMX_ERR_NONE
+        "Forced exit",                                     // AMX_ERR_EXIT
+        "Assertion failed",                                // AMX_ERR_ASSERT
+        "Stack/heap collision (insufficient stack size)",  // AMX_ERR_STACKERR
+        "Array index out of bounds",                       // AMX_ERR_BOUNDS
+        "Invalid memory access",                           // AMX_ERR_MEMACCESS
+        "Invalid instruction",                             // AMX_ERR_INVINSTR
+        "Stack underflow",                                 // AMX_ERR_STACKLOW
+        "Heap underflow",                                  // AMX_ERR_HEAPLOW
+        "No (valid) native function callback",             // AMX_ERR_CALLBACK
+        "Native function failed",                          // AMX_ERR_NATIVE
+        "Divide by zero",                                  // AMX_ERR_DIVIDE
+        "(sleep mode)",                                    // AMX_ERR_SLEEP
+        "Invalid state for this access",                   // AMX_ERR_INVSTATE
+        "(reserved)",                                      // 14
+        "(reserved)",                                      // 15
+        "Out of memory",                                   // AMX_ERR_MEMORY
+        "Invalid/unsupported P-code file format",          // AMX_ERR_FORMAT
+        "File is for a newer version of the AMX",          // AMX_ERR_VERSION
+        "File or function is not found",                   // AMX_ERR_NOTFOUND
+        "Invalid index parameter (bad entry point)",       // AMX_ERR_INDEX
+        "Debugger cannot run",                             // AMX_ERR_DEBUG
+        "AMX not initialized (or doubly initialized)",     // AMX_ERR_INIT
+        "Unable to set user data field (table full)",      // AMX_ERR_USERDATA
+        "Cannot initialize the JIT",                       // AMX_ERR_INIT_JIT
+        "Parameter error",                                 // AMX_ERR_PARAMS
+    };
+
+    if (errnum < 0 ||
+        static_cast<std::size_t>(errnum) >= std::size(messages)) {
+      return "(unknown error, " + std::to_string(errnum) + ")";
+    }
+
+    return messages[errnum];
+  }
+
+  template <typename... Args>
+  void Log(const std::string &fmt, Args... args) {
+    logger_->Log(fmt.c_str(), args...);
+  }
+
+  template <typename FmtT, typename... Args>
+  std::enable_if_t<IsFormatString<FmtT>::value> Log(FmtT fmt, Args... args) {
+    logger_->Log(fmt, args...);
+  }
+
+ private:
+  struct ErrorBucket {
+    double tokens{};
+    std::chrono::steady_clock::time_point last;
+    std::uint64_t suppressed{};
+    std::string what;
+  };
+
+  // STKMARGIN of amx.c
+  static constexpr cell stack_margin = 16 * sizeof(cell);
+
+  // An error is logged either from an amx_* function (PLUGIN_AMX_EXPORT) or
+  // from a public (its index, AMX_EXEC_MAIN included)
+  enum class ErrorSite { kFunction, kPublic };
+
+  inline std::string PublicNameForLog(int index) {
+    return index == AMX_EXEC_MAIN ? "main" : GetPublicName(index);
+  }
+
+  // Token bucket per (site, error): refilled at error_log_rate_ tokens a
+  // second, holding at most error_log_rate_ of them
+  bool AllowErrorLog(ErrorSite kind, int site, int error,
+                     std::uint64_t &suppressed) {
+    if (error_log_rate_ <= 0) {
+      return true;
+    }
+
+    auto now = std::chrono::steady_clock::now();
+    auto [iter, inserted] =
+        error_buckets_.try_emplace(std::make_tuple(kind, site, error));
+    ErrorBucket &bucket = iter->second;
+
+    if (inserted) {
+      bucket.tokens = error_log_rate_;
+      bucket.what =
+          StrError(error) + " in " +
+          (kind == ErrorSite::kPublic
+               ? "public " + PublicNameForLog(site)
+               : "amx_" + StrFunction(static_cast<PLUGIN_AMX_EXPORT>(site)));
+    } else {
+      std::chrono::duration<double> elapsed = now - bucket.last;
+
+      bucket.tokens =
+          std::min<double>(error_log_rate_,
+                           bucket.tokens + elapsed.count() * error_log_rate_);
+    }
+
+    bucket.last = now;
+
+    if (bucket.tokens < 1) {
+      ++bucket.suppressed;
+
+      return false;
+    }
+
+    bucket.tokens -= 1;
+    suppressed = bucket.suppressed;
+    bucket.suppressed = 0;
+
+    return true;
+  }
+
+  static std::string SuppressedNote(std::uint64_t suppressed) {
+    if (!suppressed) {
+      return {};
+    }
+
+    return " (suppressed " + std::to_string(suppressed) + " repeat(s))";
+  }
+
+  AMX *amx_{};
+  const AmxApi *api_{};
+  bool valid_{true};
+
+  Logger *logger_{};
+  bool log_amx_errors_{};
+  int error_log_rate_{};
+  std::map<std::tuple<ErrorSite, int, int>, ErrorBucket> error_buckets_;
+};
+
+class Public {
+ public:
+  struct HeapBlock {
+    cell amx_addr{};
+    cell *phys_addr{};
+  };
+
+  // The public table never changes while the AMX is loaded, so the index is
+  // always cached. use_caching is kept for compatibility only
+  Public(const std::string &name, const std::shared_ptr<Amx> &amx,
+         [[maybe_unused]] bool use_caching = true)
+      : amx_{amx}, name_{name}, stats_{Stats::Public(name)} {
+    exists_ = amx_->FindPublic<false>(name_.c_str(), &index_) == AMX_ERR_NONE &&
+              index_ >= 0;
+  }
+
+  // index is a resolved index or -1 if the public does not exist
+  static Public FromIndex(const std::string &name,
+                          const std::shared_ptr<Amx> &amx, int index) {
+    return Public{IndexTag{}, name, amx, index};
+  }
+
+  template <typename... Args>
+  inline cell Exec(Args... args) {
+    cell retval{};
+
+    if (!amx_->IsValid()) {
+      throw std::runtime_error{"Script with public " + name_ +
+                               " is already unloaded"};
+    }
+
+    if (!exists_) {
+      int unused{};
+      amx_->FindPublic(name_.c_str(), &unused);  // logs the error
+
+      return retval;
+    }
+
+    CallTimer timer{stats_};
+    HeapBlock heap_block{};
+
+    if constexpr (sizeof...(Args) != 0) {
+      if (!PushAll(heap_block, args...)) {
+        timer.Fail();
+
+        return retval;
+      }
+    }
+
+    if (amx_->Exec(&retval, index_, [&] { return amx_->DumpArgs(args...); }) !=
+        AMX_ERR_NONE) {
+      timer.Fail();
+    }
+
+    // The AMX heap is a bump allocator, so releasing the lowest address frees
+    // every block allotted for this call
+    cell amx_addr_to_release = heap_block.amx_addr;
+
+    if (amx_addr_to_release_) {
+      if (!amx_addr_to_release || amx_addr_to_release_ < amx_addr_to_release) {
+        amx_addr_to_release = amx_addr_to_release_;
+      }
+
+      amx_addr_to_release_ = 0;
+    }
+
+    if (amx_addr_to_release) {
+      amx_->Release(amx_addr_to_release);
+    }
+
+    return retval;
+  }
+
+  // Pushes all the arguments at once. The bodies of string arguments are
+  // written into a single Allot'd block instead of one PushString per string
+  template <typename... Args>
+  inline bool PushAll(HeapBlock &heap_block, Args... args) {
+    int heap_cells = (HeapCells(args) + ... + 0);
+
+    if (heap_cells) {
+      if (amx_->Allot(heap_cells, &heap_block.amx_addr,
+                      &heap_block.phys_addr) != AMX_ERR_NONE) {
+        heap_block = {};
+
+        return false;
+      }
+    }
+
+    PushToBlock(heap_block, 0, args...);
+
+    return true;
+  }
+
+  inline bool Exists() const { return exists_; }
+
+  inline const std::string &GetName() { return name_; }
+
+  inline const std::shared_ptr<Amx> &GetAmx() const { return amx_; }
+
+  template <typename T, typename... Args>
+  inline void Push(T arg1, Args... args) {
+    Push(args...);
+
+    Push(arg1);
+  }
+
+  template <typename T>
+  inline void Push(T arg) {
+    if constexpr (std::is_pointer<T>::value) {
+      if constexpr (std::is_same<T, const char *>::value ||
+                    std::is_same<T, char *>::value) {
+        std::size_t len = CStrLength(arg);
+        cell amx_addr{}, *phys_addr{};
+
+        if (amx_->Allot(static_cast<int>(len) + 1, &amx_addr, &phys_addr) !=
+            AMX_ERR_NONE) {
+          return;
+        }
+
+        if (len) {
+          StringKernels::Widen(phys_addr, arg, len);
+        }
+
+        phys_addr[len] = 0;
+
+        amx_->Push(amx_addr);
+
+        if (!amx_addr_to_release_ || amx_addr < amx_addr_to_release_) {
+          amx_addr_to_release_ = amx_addr;
+        }
+      } else {
+        amx_->Push(reinterpret_cast<cell>(arg));
+      }
+    } else if constexpr (std::is_floating_point<T>::value) {
+      amx_->Push(FloatToCell(static_cast<float>(arg)));
+    } else if constexpr (std::is_same<typename std::decay<T>::type,
+                                      std::string>::value) {
+      Push(arg.c_str());
+    } else {
+      amx_->Push(static_cast<cell>(arg));
+    }
+  }
+
+ private:
+  template <typename T>
+  static constexpr bool IsString() {
+    return std::is_same<T, const char *>::value ||
+           std::is_same<T, char *>::value ||
+           std::is_same<typename std::decay<T>::type, std::string>::value;
+  }
+
+  // A null C string is pushed as an empty string
+  inline static std::size_t CStrLength(const char *str) {
+    return str ? std::strlen(str) : 0;
+  }
+
+  template <typename T>
+  inline static int HeapCells(const T &arg) {
+    if constexpr (std::is_same<typename std::decay<T>::type,
+                               std::string>::value) {
+      return static_cast<int>(arg.size()) + 1;
+    } else if constexpr (IsString<T>()) {
+      return static_cast<int>(CStrLength(arg)) + 1;
+    } else {
+      return 0;
+    }
+  }
+
+  // Arguments are pushed in reverse order, strings are laid out in the block
+  // in the same (reverse) order. Returns the offset of the next free cell
+  template <typename T, typename... Args>
+  inline int PushToBlock(HeapBlock &heap_block, int offset, T arg1,
+                         Args... args) {
+    if constexpr (sizeof...(Args) != 0) {
+      offset = PushToBlock(heap_block, offset, args...);
+    }
+
+    if constexpr (IsString<T>()) {
+      int cells = HeapCells(arg1);
+      cell *dest = heap_block.phys_addr + offset;
+
+      if constexpr (std::is_same<typename std::decay<T>::type,
+                                 std::string>::value) {
+        StringKernels::Widen(dest, arg1.data(), arg1.size());
+      } else if (cells > 1) {
+        StringKernels::Widen(dest, arg1, cells - 1);
+      }
+
+      dest[cells - 1] = 0;
+
+      amx_->Push(heap_block.amx_addr +
+                 offset * static_cast<cell>(sizeof(cell)));
+
+      return offset + cells;
+    } else {
+      Push(arg1);
+
+      return offset;
+    }
+  }
+
+  struct IndexTag {};
+
+  Public(IndexTag, const std::string &name, const std::shared_ptr<Amx> &amx,
+         int index)
+      : amx_{amx},
+        name_{name},
+        index_{index},
+        exists_{index >= 0},
+        stats_{Stats::Public(name)} {}
+
+  std::shared_ptr<Amx> amx_;
+  std::string name_;
+  int index_{};
+  bool exists_{};
+  CallStats *stats_{};
+
+  cell amx_addr_to_release_{};
+};
+
+// Typed handle to a script public variable (`public gPlayerCount;`). The
+// address is resolved once, Get and Set are plain memory accesses. The
+// handle stops existing when its script is unloaded
+template <typename T = cell>
+class PublicVar {
+ public:
+  static_assert(sizeof(T) <= sizeof(cell), "T must fit into a cell");
+
+  PublicVar() = default;
+
+  // phys_addr is nullptr if the variable does not exist
+  PublicVar(const std::string &name, const std::shared_ptr<Amx> &amx,
+            cell *phys_addr)
+      : amx_{amx}, name_{name}, addr_{phys_addr} {}
+
+  inline bool Exists() const { return addr_ && amx_->IsValid(); }
+
+  inline explicit operator bool() const { return Exists(); }
+
+  inline T Get() const {
+    cell value = *Addr();
+
+    if constexpr (std::is_same<T, float>::value) {
+      return CellToFloat(value);
+    } else if constexpr (std::is_same<T, bool>::value) {
+      return value != 0;
+    } else {
+      return static_cast<T>(value);
+    }
+  }
+
+  inline void Set(T value) const {
+    if constexpr (std::is_same<T, float>::value) {
+      *Addr() = FloatToCell(value);
+    } else {
+      *Addr() = static_cast<cell>(value);
+    }
+  }
+
+  inline cell *Addr() const {
+    if (!Exists()) {
+      throw std::runtime_error{"Public variable " + name_ +
+                               (addr_ ? " belongs to an unloaded script"
+                                      : " does not exist")};
+    }
+
+    return addr_;
+  }
+
+  inline const std::string &GetName() const { return name_; }
+
+ private:
+  std::shared_ptr<Amx> amx_;
+  std::string name_;
+  cell *addr_{};
+};
+
+// Bump allocator for temporaries of natives. Every generated native takes a
+// mark on entry and rolls back to it on return, so the same chunks serve all
+// the calls and are never freed. Server thread only
+class ScratchArena {
+ public:
+  static constexpr std::size_t chunk_size = 64 * 1024;
+
+  struct Mark {
+    std::size_t chunk{};
+    std::size_t offset{};
+  };
+
+  // Releases everything allocated during its lifetime
+  class Scope {
+   public:
+    explicit Scope(ScratchArena &arena)
+        : arena_{arena}, mark_{arena.GetMark()} {}
+
+    ~Scope() { arena_.Release(mark_); }
+
+    Scope(const Scope &) = delete;
+    Scope &operator=(const Scope &) = delete;
+
+   private:
+    ScratchArena &arena_;
+    Mark mark_;
+  };
+
+  void *Allocate(std::size_t size,
+                 std::size_t align = alignof(std::max_align_t)) {
+    for (;;) {
+      if (chunk_ == chunks_.size()) {
+        std::size_t capacity = std::max(chunk_size, size + align);
+
+        chunks_.push_back({std::unique_ptr<char[]>{new char[capacity]},
+                           capacity});
+      }
+
+      auto &chunk = chunks_[chunk_];
+      auto base = reinterpret_cast<std::uintptr_t>(chunk.data.get());
+      std::size_t offset =
+          ((base + offset_ + align - 1) & ~(align - 1)) - base;
+
+      if (offset + size <= chunk.capacity) {
+        offset_ = offset + size;
+
+        return chunk.data.get() + offset;
+      }
+
+      // Kept for later calls, smaller requests may still fit in it
+      ++chunk_;
+      offset_ = 0;
+    }
+  }
+
+  template <typename T>
+  inline T *Allocate(std::size_t count) {
+    return static_cast<T *>(Allocate(sizeof(T) * count, alignof(T)));
+  }
+
+  // Null-terminated copy
+  std::string_view Copy(std::string_view str) {
+    char *data = Allocate<char>(str.size() + 1);
+
+    std::memcpy(data, str.data(), str.size());
+    data[str.size()] = '\0';
+
+    return {data, str.size()};
+  }
+
+  inline Mark GetMark() const { return {chunk_, offset_}; }
+
+  inline void Release(const Mark &mark) {
+    chunk_ = mark.chunk;
+    offset_ = mark.offset;
+  }
+
+  std::size_t Capacity() const {
+    std::size_t capacity{};
+
+    for (const auto &chunk : chunks_) {
+      capacity += chunk.capacity;
+    }
+
+    return capacity;
+  }
+
+ private:
+  struct Chunk {
+    std::unique_ptr<char[]> data;
+    std::size_t capacity{};
+  };
+
+  std::vector<Chunk> chunks_;
+  std::size_t chunk_{};
+  std::size_t offset_{};
+};
+
+// Standard allocator over a ScratchArena, deallocation is a no-op
+template <typename T>
+class ScratchAllocator {
+ public:
+  using value_type = T;
+
+  explicit ScratchAllocator(ScratchArena &arena) : arena_{&arena} {}
+
+  template <typename U>
+  ScratchAllocator(const ScratchAllocator<U> &other)
+      : arena_{&other.Arena()} {}
+
+  inline T *allocate(std::size_t n) { return arena_->Allocate<T>(n); }
+
+  inline void deallocate(T *, std::size_t) {}
+
+  inline ScratchArena &Arena() const { return *arena_; }
+
+  template <typename U>
+  inline bool operator==(const ScratchAllocator<U> &other) const {
+    return arena_ == &other.Arena();
+  }
+
+  template <typename U>
+  inline bool operator!=(const ScratchAllocator<U> &other) const {
+    return !(*this == other);
+  }
+
+ private:
+  ScratchArena *arena_{};
+};
+
+using ScratchString =
+    std::basic_string<char, std::char_traits<char>, ScratchAllocator<char>>;
+
+template <typename T>
+using ScratchVector = std::vector<T, ScratchAllocator<T>>;
+
+// Script string decoded once from AMX memory into a buffer it owns: inline up
+// to inline_capacity characters, on the heap beyond. Unlike std::string_view
+// parameters it does not use the scratch arena, so it can outlive the native
+class AmxStringBuffer {
+ public:
+  static constexpr std::size_t inline_capacity = 128;
+
+  explicit AmxStringBuffer(const cell *src) {
+    if (!src) {
+      Reserve(0);
+      return;
+    }
+
+    std::size_t len = StringKernels::Length(src);
+
+    StringKernels::Narrow(Reserve(len), src, len);
+  }
+
+  AmxStringBuffer(const AmxStringBuffer &) = delete;
+  AmxStringBuffer &operator=(const AmxStringBuffer &) = delete;
+
+  inline const char *Data() const { return data_; }
+
+  inline std::size_t Size() const { return size_; }
+
+  inline bool Empty() const { return size_ == 0; }
+
+  inline std::string_view View() const { return {data_, size_}; }
+
+  inline operator std::string_view() const { return View(); }
+
+  inline std::string Str() const { return {data_, size_}; }
+
+ private:
+  inline char *Reserve(std::size_t len) {
+    if (len > inline_capacity) {
+      heap_.reset(new char[len + 1]);
+      data_ = heap_.get();
+    }
+
+    data_[len] = '\0';
+    size_ = len;
+
+    return data_;
+  }
+
+  char buffer_[inline_capacity + 1];
+  std::unique_ptr<char[]> heap_;
+  char *data_{buffer_};
+  std::size_t size_{};
+};
+
+// View of a script array, taken by natives as two parameters: the array and
+// its size, like `arr[], size = sizeof arr` in Pawn. The range is validated
+// once before the native is called, the elements are not copied
+template <typename T>
+class Span {
+ public:
+  static_assert(sizeof(T) == sizeof(cell), "T must have the size of a cell");
+
+  Span() = default;
+
+  Span(T *data, std::size_t size) : data_{data}, size_{size} {}
+
+  inline T *Data() const { return data_; }
+
+  inline std::size_t Size() const { return size_; }
+
+  inline bool Empty() const { return size_ == 0; }
+
+  inline T &operator[](std::size_t index) const { return data_[index]; }
+
+  inline T *begin() const { return data_; }
+
+  inline T *end() const { return data_ + size_; }
+
+ private:
+  T *data_{};
+  std::size_t size_{};
+};
+
+// Output string parameter, taken by natives as two parameters: the
+// destination array and its size, like `dest[], size = sizeof dest` in Pawn.
+// Text is written straight into the script's buffer and is always
+// null-terminated and truncated to fit
+class OutString {
+ public:
+  OutString(cell *dest, std::size_t size) : dest_{dest}, size_{size} {}
+
+  // Packed strings hold 4 characters per cell; switching clears the string
+  inline OutString &SetPacked(bool packed) {
+    packed_ = packed;
+
+    return Clear();
+  }
+
+  inline OutString &Clear() {
+    length_ = 0;
+
+    Terminate();
+
+    return *this;
+  }
+
+  inline OutString &Write(std::string_view str) {
+    length_ = 0;
+
+    return Append(str);
+  }
+
+  inline OutString &Append(std::string_view str) {
+    std::size_t len = std::min(str.size(), Capacity() - length_);
+
+    if (packed_) {
+      for (std::size_t i = 0; i < len; ++i) {
+        PutPacked(length_ + i, str[i]);
+      }
+    } else {
+      StringKernels::Widen(dest_ + length_, str.data(), len);
     }
 
-    return functions[func];
+    length_ += len;
+
+    Terminate();
+
+    return *this;
   }
 
-  inline const std::string StrError(int errnum) {
-    static const std::string messages[] = {
-        "(none)",                                          // AMX_ERR_NONE
-        "Forced exit",                                     // AMX_ERR_EXIT
-        "Assertion failed",                                // AMX_ERR_ASSERT
-        "Stack/heap collision (insufficient stack size)",  // AMX_ERR_STACKERR
-        "Array index out of bounds",                       // AMX_ERR_BOUNDS
-        "Invalid memory access",                           // AMX_ERR_MEMACCESS
-        "Invalid instruction",                             // AMX_ERR_INVINSTR
-        "Stack underflow",                                 // AMX_ERR_STACKLOW
-        "Heap underflow",                                  // AMX_ERR_HEAPLOW
-        "No (valid) native function callback",             // AMX_ERR_CALLBACK
-        "Native function failed",                          // AMX_ERR_NATIVE
-        "Divide by zero",                                  // AMX_ERR_DIVIDE
-        "(sleep mode)",                                    // AMX_ERR_SLEEP
-        "Invalid state for this access",                   // AMX_ERR_INVSTATE
-        "(reserved)",                                      // 14
-        "(reserved)",                                      // 15
-        "Out of memory",                                   // AMX_ERR_MEMORY
-        "Invalid/unsupported P-code file format",          // AMX_ERR_FORMAT
-        "File is for a newer version of the AMX",          // AMX_ERR_VERSION
-        "File or function is not found",                   // AMX_ERR_NOTFOUND
-        "Invalid index parameter (bad entry point)",       // AMX_ERR_INDEX
-        "Debugger cannot run",                             // AMX_ERR_DEBUG
-        "AMX not initialized (or doubly initialized)",     // AMX_ERR_INIT
-        "Unable to set user data field (table full)",      // AMX_ERR_USERDATA
-        "Cannot initialize the JIT",                       // AMX_ERR_INIT_JIT
-        "Parameter error",                                 // AMX_ERR_PARAMS
-    };
+  // snprintf-like, appends to the string. Unpacked output is formatted
+  // in place into the free tail of the buffer and then widened to cells
+  PTL_PRINTF_FORMAT(2, 3) OutString &Printf(const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    AppendFormatted(fmt, args);
+    va_end(args);
 
-    if (errnum < 0 || errnum >= (sizeof(messages) / sizeof(messages[0]))) {
-      return "(unknown error, " + std::to_string(errnum) + ")";
+    return *this;
+  }
+
+  inline OutString &operator<<(std::string_view str) { return Append(str); }
+
+  // A null C string is appended as an empty string, like Public::Push
+  inline OutString &operator<<(const char *str) {
+    return str ? Append(str) : *this;
+  }
+
+  inline OutString &operator<<(const std::string &str) { return Append(str); }
+
+  inline OutString &operator<<(char c) { return Append({&c, 1}); }
+
+  template <typename T, typename = std::enable_if_t<std::is_arithmetic_v<T>>>
+  inline OutString &operator<<(T value) {
+    if constexpr (std::is_floating_point_v<T>) {
+      return Printf("%f", static_cast<double>(value));
+    } else if constexpr (std::is_signed_v<T>) {
+      return Printf("%lld", static_cast<long long>(value));
+    } else {
+      return Printf("%llu", static_cast<unsigned long long>(value));
     }
+  }
 
-    return messages[errnum];
+  inline std::size_t Length() const { return length_; }
+
+  // Max number of characters, without the null terminator
+  inline std::size_t Capacity() const {
+    if (!size_) {
+      return 0;
+    }
+
+    return packed_ ? size_ * sizeof(cell) - 1 : size_ - 1;
   }
 
-  template <typename... Args>
-  void Log(const std::string &fmt, Args... args) {
-    if (!logprintf_) {
-      throw std::runtime_error{"logprintf_ is null"};
+ private:
+  void AppendFormatted(const char *fmt, va_list args) {
+    if (!size_) {
+      return;
+    }
+
+    std::size_t free = Capacity() - length_;
+
+    if (packed_) {
+      // Packed cells are big-endian, so format into a byte buffer sized for
+      // the free space and append. The stack covers the usual short strings
+      char stack_buf[256];
+      std::unique_ptr<char[]> heap_buf;
+      char *buf = stack_buf;
+
+      if (free + 1 > sizeof(stack_buf)) {
+        heap_buf.reset(new char[free + 1]);
+        buf = heap_buf.get();
+      }
+
+      int written = std::vsnprintf(buf, free + 1, fmt, args);
+
+      if (written > 0) {
+        Append({buf, std::min(static_cast<std::size_t>(written), free)});
+      }
+
+      return;
+    }
+
+    // The free cells have room for 4x more bytes than we need, and bytes are
+    // widened back to front, so no unread byte is overwritten
+    char *bytes = reinterpret_cast<char *>(dest_ + length_);
+    int written = std::vsnprintf(bytes, free + 1, fmt, args);
+    std::size_t len =
+        written > 0 ? std::min(static_cast<std::size_t>(written), free) : 0;
+
+    for (std::size_t i = len; i-- > 0;) {
+      dest_[length_ + i] = static_cast<unsigned char>(bytes[i]);
+    }
+
+    length_ += len;
+
+    Terminate();
+  }
+
+  inline void PutPacked(std::size_t index, char c) {
+    cell &dest = dest_[index / sizeof(cell)];
+    int shift = (sizeof(cell) - 1 - index % sizeof(cell)) * 8;
+
+    if (index % sizeof(cell) == 0) {
+      dest = 0;
+    }
+
+    dest = static_cast<cell>(
+        static_cast<ucell>(dest) |
+        (static_cast<ucell>(static_cast<unsigned char>(c)) << shift));
+  }
+
+  inline void Terminate() {
+    if (!size_) {
+      return;
     }
 
-    if (plugin_name_.empty()) {
-      logprintf_(fmt.c_str(), args...);
+    if (packed_) {
+      // The rest of the last cell must be zero as well
+      if (length_ % sizeof(cell) == 0) {
+        dest_[length_ / sizeof(cell)] = 0;
+      }
     } else {
-      logprintf_(("[%s] " + fmt).c_str(), plugin_name_.c_str(), args...);
+      dest_[length_] = 0;
     }
   }
 
+  cell *dest_{};
+  std::size_t size_{};
+  std::size_t length_{};
+  bool packed_{};
+};
+
+// Every live HandleTable, so the handles owned by a script can be released
+// when it is unloaded
+class HandleTableBase {
+ public:
+  HandleTableBase(const HandleTableBase &) = delete;
+  HandleTableBase &operator=(const HandleTableBase &) = delete;
+
+  virtual void ReleaseOwnedBy(AMX *owner) = 0;
+
+  static void ReleaseAllOwnedBy(AMX *owner) {
+    for (auto table : Tables()) {
+      table->ReleaseOwnedBy(owner);
+    }
+  }
+
+ protected:
+  HandleTableBase() { Tables().push_back(this); }
+
+  virtual ~HandleTableBase() {
+    auto &tables = Tables();
+
+    tables.erase(std::remove(tables.begin(), tables.end(), this),
+                 tables.end());
+  }
+
  private:
-  AMX *amx_{};
-  void *amx_functions_{};
+  static std::vector<HandleTableBase *> &Tables() {
+    static std::vector<HandleTableBase *> tables;
 
-  LogPrintf logprintf_{};
-  std::string plugin_name_;
-  bool log_amx_errors_{};
+    return tables;
+  }
 };
 
-class Public {
+// Generational slot map that hands out integer handles to scripts. Lookups
+// are O(1), and a released handle stays invalid until its slot has been
+// reused generation_mask + 1 times (freed slots are reused in FIFO order).
+// Objects owned by a script are destroyed when it is unloaded, objects
+// without an owner live until they are released. The table returned by
+// Instance() backs the Handle<T> native parameters. Server thread only
+template <typename T>
+class HandleTable : public HandleTableBase {
  public:
-  Public(const std::string &name, const std::shared_ptr<Amx> &amx,
-         bool use_caching = false)
-      : amx_{amx}, name_{name}, use_caching_{use_caching} {
-    exists_ = amx_->FindPublic<false>(name_.c_str(), &index_) == AMX_ERR_NONE &&
-              index_ >= 0;
+  static constexpr int index_bits = 20;
+  static constexpr std::uint32_t index_mask = (1u << index_bits) - 1;
+  static constexpr std::uint32_t generation_mask =
+      (1u << (31 - index_bits)) - 1;
+  static constexpr std::size_t max_size = index_mask;  // 0 is never a handle
+
+  HandleTable() = default;
+
+  ~HandleTable() override = default;
+
+  static HandleTable &Instance() {
+    static HandleTable instance;
+
+    return instance;
   }
 
   template <typename... Args>
-  inline cell Exec(Args... args) {
-    cell retval{};
+  cell Emplace(AMX *owner, Args &&... args) {
+    std::uint32_t index{};
 
-    if (use_caching_) {
-      if (!cached_) {
-        amx_->FindPublic(name_.c_str(), &index_);
-
-        cached_ = true;
+    if (free_.empty()) {
+      if (slots_.size() == max_size) {
+        throw std::runtime_error{"Handle table is full"};
       }
-    } else {
-      amx_->FindPublic(name_.c_str(), &index_);
+
+      slots_.emplace_back();
+      free_.push_back(static_cast<std::uint32_t>(slots_.size() - 1));
     }
 
-    std::string debug_args_values = "";
+    index = free_.front();
 
-    if constexpr (sizeof...(Args) != 0) {
-      Push(args...);
+    auto &slot = slots_[index];
 
-      debug_args_values = amx_->DumpArgs(args...);
-    }
+    slot.value.emplace(std::forward<Args>(args)...);
+    slot.owner = owner;
 
-    amx_->Exec(&retval, index_, debug_args_values);
+    free_.pop_front();
+    ++size_;
 
-    if (amx_addr_to_release_) {
-      amx_->Release(amx_addr_to_release_);
+    return static_cast<cell>((slot.generation << index_bits) | (index + 1));
+  }
 
-      amx_addr_to_release_ = 0;
-    }
+  inline T *Get(cell handle) {
+    auto slot = Find(handle);
 
-    return retval;
+    return slot ? &*slot->value : nullptr;
   }
 
-  inline bool Exists() const { return exists_; }
+  inline bool Contains(cell handle) { return Find(handle) != nullptr; }
 
-  inline const std::string &GetName() { return name_; }
+  // nullptr for objects without an owner and for invalid handles
+  inline AMX *GetOwner(cell handle) {
+    auto slot = Find(handle);
 
-  template <typename T, typename... Args>
-  inline void Push(T arg1, Args... args) {
-    Push(args...);
+    return slot ? slot->owner : nullptr;
+  }
 
-    Push(arg1);
+  bool Release(cell handle) {
+    auto slot = Find(handle);
+
+    if (!slot) {
+      return false;
+    }
+
+    ReleaseSlot(*slot, (static_cast<std::uint32_t>(handle) & index_mask) - 1);
+
+    return true;
   }
 
-  template <typename T>
-  inline void Push(T arg) {
-    if constexpr (std::is_pointer<T>::value) {
-      if constexpr (std::is_same<T, const char *>::value ||
-                    std::is_same<T, char *>::value) {
-        cell amx_addr{};
+  void ReleaseOwnedBy(AMX *owner) override {
+    if (!owner) {
+      return;
+    }
 
-        amx_->PushString(&amx_addr, nullptr, arg, 0, 0);
+    for (std::size_t i = 0; i < slots_.size(); ++i) {
+      if (slots_[i].value && slots_[i].owner == owner) {
+        ReleaseSlot(slots_[i], static_cast<std::uint32_t>(i));
+      }
+    }
+  }
 
-        if (!amx_addr_to_release_) {
-          amx_addr_to_release_ = amx_addr;
-        }
-      } else {
-        amx_->Push(reinterpret_cast<cell>(arg));
+  void Clear() {
+    for (std::size_t i = 0; i < slots_.size(); ++i) {
+      if (slots_[i].value) {
+        ReleaseSlot(slots_[i], static_cast<std::uint32_t>(i));
       }
-    } else if constexpr (std::is_floating_point<T>::value) {
-      amx_->Push(amx_ftoc(arg));
-    } else if constexpr (std::is_same<typename std::decay<T>::type,
-                                      std::string>::value) {
-      Push(arg.c_str());
-    } else {
-      amx_->Push(static_cast<cell>(arg));
     }
   }
 
+  inline std::size_t Size() const { return size_; }
+
+  inline bool Empty() const { return size_ == 0; }
+
  private:
-  std::shared_ptr<Amx> amx_;
-  std::string name_;
-  int index_{};
-  bool exists_{};
-  bool cached_{};
-  bool use_caching_{};
+  // A deque keeps the objects in place when the table grows
+  struct Slot {
+    std::optional<T> value;
+    std::uint32_t generation{};
+    AMX *owner{};
+  };
 
-  cell amx_addr_to_release_{};
+  inline Slot *Find(cell handle) {
+    auto raw = static_cast<std::uint32_t>(handle);
+    std::uint32_t index = (raw & index_mask) - 1;  // 0 wraps past the end
+
+    if (handle <= 0 || index >= slots_.size()) {
+      return nullptr;
+    }
+
+    auto &slot = slots_[index];
+
+    if (!slot.value || slot.generation != (raw >> index_bits)) {
+      return nullptr;
+    }
+
+    return &slot;
+  }
+
+  void ReleaseSlot(Slot &slot, std::uint32_t index) {
+    slot.value.reset();
+    slot.owner = nullptr;
+    slot.generation = (slot.generation + 1) & generation_mask;
+
+    free_.push_back(index);
+    --size_;
+  }
+
+  std::deque<Slot> slots_;
+  std::deque<std::uint32_t> free_;
+  std::size_t size_{};
+};
+
+// Native parameter holding an object of HandleTable<T>::Instance(). The
+// handle is checked before the native is called, so the object exists
+template <typename T>
+class Handle {
+ public:
+  Handle(cell value, T &object) : value_{value}, object_{&object} {}
+
+  inline T &Get() const { return *object_; }
+
+  inline T &operator*() const { return *object_; }
+
+  inline T *operator->() const { return object_; }
+
+  // The handle as the script sees it
+  inline cell Value() const { return value_; }
+
+ private:
+  cell value_{};
+  T *object_{};
+};
+
+template <typename T>
+struct IsHandle : std::false_type {};
+
+template <typename T>
+struct IsHandle<Handle<T>> : std::true_type {
+  using Object = T;
+};
+
+// Number of native parameters (cells) a native argument type consumes
+template <typename T>
+struct NativeParamWidth : std::integral_constant<std::size_t, 1> {};
+
+template <typename T>
+struct NativeParamWidth<Span<T>> : std::integral_constant<std::size_t, 2> {};
+
+template <>
+struct NativeParamWidth<OutString> : std::integral_constant<std::size_t, 2> {};
+
+template <typename T>
+struct IsSpan : std::false_type {};
+
+template <typename T>
+struct IsSpan<Span<T>> : std::true_type {
+  using Element = T;
+};
+
+template <typename T>
+struct IsTuple : std::false_type {};
+
+template <typename... Args>
+struct IsTuple<std::tuple<Args...>> : std::true_type {};
+
+// Native argument types decoded from a script string
+template <typename T>
+struct IsStringParam
+    : std::integral_constant<
+          bool, std::is_same<T, std::string>::value ||
+                    std::is_same<T, std::string_view>::value ||
+                    std::is_same<T, AmxStringBuffer>::value ||
+                    std::is_same<T, ScratchString>::value> {};
+
+// How generated natives report a malformed call: a wrong number of
+// parameters, an invalid address or handle
+enum class NativeParamErrors {
+  kThrow,  // a std::runtime_error, logged by the native like any other
+  kRaise,  // logged and raised in the script as AMX_ERR_PARAMS, no unwinding
 };
 
 template <typename ScriptT>
@@ -532,7 +3140,7 @@ class AbstractScript {
 
     operator cell *() { return script.GetPhysAddr(raw_value); }
 
-    operator float() { return amx_ctof(raw_value); }
+    operator float() { return CellToFloat(raw_value); }
 
     operator float *() {
       return reinterpret_cast<float *>(script.GetPhysAddr(raw_value));
@@ -540,6 +3148,12 @@ class AbstractScript {
 
     operator std::string() { return script.GetString(raw_value); }
 
+    operator AmxStringBuffer() { return script.GetStringBuffer(raw_value); }
+
+    operator std::string_view() { return script.GetStringView(raw_value); }
+
+    operator ScratchString() { return script.GetScratchString(raw_value); }
+
     cell raw_value{};
     ScriptT &script{};
   };
@@ -549,53 +3163,206 @@ class AbstractScript {
     return T{value, static_cast<ScriptT &>(*this)};
   }
 
-  bool IsGamemode() const { return is_gamemode_; }
+  bool IsGamemode() const { return is_gamemode_; }
+
+  std::string GetPublicName(int index) { return amx_->GetPublicName(index); }
+
+  // Resolved only once per script. Keep the returned handle to poll the
+  // variable without any lookups
+  template <typename T = cell>
+  PublicVar<T> GetPublicVar(const std::string &name) {
+    return PublicVar<T>{name, amx_, GetPublicVarAddr(name)};
+  }
+
+  // Same conversion as PublicVar<T>::Get
+  template <typename T = cell>
+  T GetPublicVarValue(const char *name) {
+    auto var = GetPublicVar<T>(name);
+
+    if (!var.Exists()) {
+      cell unused{};
+      amx_->FindPubVar(name, &unused);  // logs the error
+
+      return T{};
+    }
+
+    return var.Get();
+  }
+
+  bool PublicVarExists(const char *name) {
+    return GetPublicVarAddr(name) != nullptr;
+  }
+
+  std::string GetString(cell amx_addr) {
+    const cell *addr = GetStringAddr(amx_addr);
+    std::string str(StringKernels::Length(addr), '\0');
+
+    StringKernels::Narrow(str.data(), addr, str.size());
+
+    return str;
+  }
+
+  AmxStringBuffer GetStringBuffer(cell amx_addr) {
+    return AmxStringBuffer{GetStringAddr(amx_addr)};
+  }
+
+  // Decoded into the scratch arena, valid until the current native returns
+  // (or the tick or OnLoad, outside natives)
+  std::string_view GetStringView(cell amx_addr) {
+    const cell *addr = GetStringAddr(amx_addr);
+    std::size_t len = StringKernels::Length(addr);
+    char *str = scratch_->Allocate<char>(len + 1);
+
+    StringKernels::Narrow(str, addr, len);
+    str[len] = '\0';
+
+    return {str, len};
+  }
+
+  ScratchString GetScratchString(cell amx_addr) {
+    const cell *addr = GetStringAddr(amx_addr);
+    ScratchString str(StringKernels::Length(addr), '\0',
+                      ScratchAllocator<char>{*scratch_});
+
+    StringKernels::Narrow(str.data(), addr, str.size());
+
+    return str;
+  }
+
+  // Temporaries released when the current native, tick or script OnLoad
+  // returns. Anywhere else, open a ScratchArena::Scope around their use
+  inline ScratchArena &Scratch() { return *scratch_; }
+
+  template <typename T>
+  inline ScratchAllocator<T> ScratchAlloc() {
+    return ScratchAllocator<T>{*scratch_};
+  }
+
+  // Unpacked, truncated to size - 1 characters and null-terminated
+  void SetString(cell *dest, std::string_view src, std::size_t size) {
+    if (!size) {
+      return;
+    }
+
+    std::size_t len = std::min(src.size(), size - 1);
+
+    StringKernels::Widen(dest, src.data(), len);
+
+    dest[len] = 0;
+  }
+
+  // Same checks as amx_GetAddr: the address must be inside the data segment,
+  // the heap or the stack, but not in the gap between heap and stack
+  inline bool IsValidAddr(cell amx_addr) const {
+    return amx_addr >= 0 && amx_addr < stp_ &&
+           (amx_addr < amx_ptr_->hea || amx_addr >= amx_ptr_->stk);
+  }
+
+  // The whole array must be inside the data segment, the heap or the stack
+  inline bool IsValidRange(cell amx_addr, cell cells) const {
+    if (cells < 0 || cells > stp_ / static_cast<cell>(sizeof(cell)) ||
+        !IsValidAddr(amx_addr)) {
+      return false;
+    }
+
+    if (cells == 0) {
+      return true;
+    }
+
+    cell last = amx_addr + (cells - 1) * static_cast<cell>(sizeof(cell));
+
+    return IsValidAddr(last) &&
+           (amx_addr < amx_ptr_->hea) == (last < amx_ptr_->hea);
+  }
+
+  inline cell *GetPhysAddr(cell amx_addr) {
+    if (IsValidAddr(amx_addr)) {
+      return reinterpret_cast<cell *>(data_ + amx_addr);
+    }
+
+    cell *phys_addr{};
+
+    amx_->GetAddr(amx_addr, &phys_addr);  // logs the error
+
+    return phys_addr;
+  }
+
+  void RegisterNative(const char *name, AMX_NATIVE func) {
+    amx_->Register<false>(amx_->NativeInfo(name, func), 1);
+  }
+
+  // amx_Register scans the whole native table of the script, so it is much
+  // cheaper to register all the natives with a single call
+  void RegisterNatives(const AMX_NATIVE_INFO *list, int number) {
+    amx_->Register<false>(list, number);
+  }
+
+  std::vector<std::string> GetUnresolvedNatives() {
+    std::vector<std::string> names;
 
-  std::string GetPublicName(int index) { return amx_->GetPublicName(index); }
+    auto amx = amx_->GetPtr();
+    auto hdr = reinterpret_cast<AMX_HEADER *>(amx->base);
 
-  template <typename T = cell>
-  T GetPublicVarValue(const char *name) {
-    cell amx_addr{};
-    amx_->FindPubVar(name, &amx_addr);
+    if (!hdr->defsize) {
+      return names;
+    }
 
-    return static_cast<T>(*GetPhysAddr(amx_addr));
-  }
+    int num_natives = (hdr->libraries - hdr->natives) / hdr->defsize;
 
-  bool PublicVarExists(const char *name) {
-    cell unused{};
-    return amx_->FindPubVar<false>(name, &unused) == AMX_ERR_NONE;
-  }
+    int len{};
+    amx_->NameLength(&len);
 
-  std::string GetString(cell amx_addr) {
-    cell *addr = GetPhysAddr(amx_addr);
+    std::unique_ptr<char[]> name{new char[len + 1]{}};
 
-    int len{};
-    amx_->StrLen(addr, &len);
+    for (int i = 0; i < num_natives; ++i) {
+      // address is the first field of both AMX_FUNCSTUB and AMX_FUNCSTUBNT
+      auto stub = reinterpret_cast<AMX_FUNCSTUBNT *>(
+          amx->base + hdr->natives + i * hdr->defsize);
 
-    std::unique_ptr<char[]> str{new char[len + 1]{}};
-    amx_->GetString(str.get(), addr, 0, len + 1);
+      if (!stub->address && amx_->GetNative(i, name.get()) == AMX_ERR_NONE) {
+        names.push_back(name.get());
+      }
+    }
 
-    return str.get();
+    return names;
   }
 
-  void SetString(cell *dest, const std::string &src, std::size_t size) {
-    amx_->SetString(dest, src.c_str(), 0, 0, size);
+  // Returns the index of the public or -1 if it doesn't exist. Resolved only
+  // once per script
+  int GetPublicIndex(const std::string &name) {
+    auto cached = public_indices_.find(name);
+
+    if (cached != public_indices_.end()) {
+      return cached->second;
+    }
+
+    return ResolvePublicIndex(name);
   }
 
-  cell *GetPhysAddr(cell amx_addr) {
-    cell *phys_addr{};
+  // Returns the address of the public variable or nullptr if it doesn't
+  // exist. Resolved only once per script
+  cell *GetPublicVarAddr(const std::string &name) {
+    auto cached = public_var_addrs_.find(name);
 
-    amx_->GetAddr(amx_addr, &phys_addr);
+    if (cached != public_var_addrs_.end()) {
+      return cached->second;
+    }
 
-    return phys_addr;
+    return ResolvePublicVarAddr(name);
   }
 
-  void RegisterNative(const char *name, AMX_NATIVE func) {
-    amx_->Register<false>(amx_->NativeInfo(name, func), 1);
+  auto MakePublic(const std::string &name,
+                  [[maybe_unused]] bool use_caching = true) {
+    int index = GetPublicIndex(name);
+
+    return std::make_shared<Public>(Public::FromIndex(name, amx_, index));
   }
 
-  auto MakePublic(const std::string &name, bool use_caching = false) {
-    return std::make_shared<Public>(name, amx_, use_caching);
+  // New object in HandleTable<T>::Instance(), released with the script
+  template <typename T, typename... Args>
+  cell MakeHandle(Args &&... args) {
+    return HandleTable<T>::Instance().Emplace(amx_ptr_,
+                                              std::forward<Args>(args)...);
   }
 
   const char *VarVersion() { return nullptr; };
@@ -604,29 +3371,47 @@ class AbstractScript {
 
   bool OnLoad() { return true; }
 
-  void Init(AMX *amx, void *amx_functions, bool log_amx_errors,
-            LogPrintf logprintf, const std::string &plugin_name) {
+  void Init(AMX *amx, const AmxApi &amx_api, bool log_amx_errors,
+            int amx_error_log_rate, Logger &logger, ScratchArena &scratch) {
     impl_ = static_cast<ScriptT *>(this);
 
-    logprintf_ = logprintf;
+    logger_ = &logger;
+    scratch_ = &scratch;
+
+    amx_ = std::make_shared<Amx>(amx, amx_api, log_amx_errors,
+                                 amx_error_log_rate, logger);
+
+    // Neither the data segment nor the top of the stack move after amx_Init
+    amx_ptr_ = amx;
+    data_ = amx_->GetData();
+    stp_ = amx->stp;
+
+    // Publics and variables requested by any script so far are resolved up
+    // front
+    for (const auto &name : RequestedPublics()) {
+      ResolvePublicIndex(name);
+    }
+
+    for (const auto &name : RequestedPublicVars()) {
+      ResolvePublicVarAddr(name);
+    }
 
-    plugin_name_ = plugin_name;
+    if (impl_->VarVersion()) {
+      version_var_ = GetPublicVar<int>(impl_->VarVersion());
+    }
 
-    amx_ = std::make_shared<Amx>(amx, amx_functions, log_amx_errors, logprintf,
-                                 plugin_name);
+    if (impl_->VarIsGamemode()) {
+      auto is_gamemode = GetPublicVar<bool>(impl_->VarIsGamemode());
 
-    if (impl_->VarIsGamemode() && PublicVarExists(impl_->VarIsGamemode())) {
-      is_gamemode_ = GetPublicVarValue<bool>(impl_->VarIsGamemode());
+      is_gamemode_ = is_gamemode && is_gamemode.Get();
     }
   }
 
   const auto &GetAmx() const { return amx_; }
 
-  bool HasVersion() {
-    return impl_->VarVersion() && PublicVarExists(impl_->VarVersion());
-  }
+  bool HasVersion() const { return version_var_.Exists(); }
 
-  int GetVersion() { return GetPublicVarValue<int>(impl_->VarVersion()); }
+  int GetVersion() const { return version_var_.Get(); }
 
   inline void AssertParams(std::size_t count, cell *params) const {
     if (static_cast<ucell>(params[0]) != (count * sizeof(cell))) {
@@ -644,25 +3429,85 @@ class AbstractScript {
 
   template <typename... Args>
   void Log(const std::string &fmt, Args... args) {
-    if (!logprintf_) {
-      throw std::runtime_error{"logprintf_ is null"};
-    }
+    logger_->Log(fmt.c_str(), args...);
+  }
 
-    if (plugin_name_.empty()) {
-      logprintf_(fmt.c_str(), args...);
-    } else {
-      logprintf_(("[%s] " + fmt).c_str(), plugin_name_.c_str(), args...);
-    }
+  template <typename FmtT, typename... Args>
+  std::enable_if_t<IsFormatString<FmtT>::value> Log(FmtT fmt, Args... args) {
+    logger_->Log(fmt, args...);
   }
 
   inline bool operator==(AMX *amx) { return amx_->GetPtr() == amx; }
 
  protected:
+  // The string kernels read from the address, so it must be valid
+  inline const cell *GetStringAddr(cell amx_addr) {
+    const cell *addr = GetPhysAddr(amx_addr);
+
+    if (!addr) {
+      throw std::runtime_error{"Invalid string address " +
+                               std::to_string(amx_addr)};
+    }
+
+    return addr;
+  }
+
+  int ResolvePublicIndex(const std::string &name) {
+    int index{};
+
+    if (amx_->FindPublic<false>(name.c_str(), &index) != AMX_ERR_NONE ||
+        index < 0) {
+      index = -1;
+    }
+
+    if (public_indices_.emplace(name, index).second) {
+      RequestedPublics().insert(name);
+    }
+
+    return index;
+  }
+
+  cell *ResolvePublicVarAddr(const std::string &name) {
+    cell amx_addr{};
+    cell *addr{};
+
+    if (amx_->FindPubVar<false>(name.c_str(), &amx_addr) == AMX_ERR_NONE &&
+        IsValidAddr(amx_addr)) {
+      addr = reinterpret_cast<cell *>(data_ + amx_addr);
+    }
+
+    if (public_var_addrs_.emplace(name, addr).second) {
+      RequestedPublicVars().insert(name);
+    }
+
+    return addr;
+  }
+
+  static std::unordered_set<std::string> &RequestedPublics() {
+    static std::unordered_set<std::string> names;
+
+    return names;
+  }
+
+  static std::unordered_set<std::string> &RequestedPublicVars() {
+    static std::unordered_set<std::string> names;
+
+    return names;
+  }
+
+  std::unordered_map<std::string, int> public_indices_;
+  std::unordered_map<std::string, cell *> public_var_addrs_;
+  PublicVar<int> version_var_;
+
+  AMX *amx_ptr_{};
+  unsigned char *data_{};
+  cell stp_{};
+
   std::shared_ptr<Amx> amx_;
   bool is_gamemode_{};
 
-  LogPrintf logprintf_{};
-  std::string plugin_name_;
+  Logger *logger_{};
+  ScratchArena *scratch_{};
 
  private:
   ScriptT *impl_{};
@@ -706,23 +3551,236 @@ class AbstractPlugin {
     Instance().LogImpl(fmt, args...);
   }
 
+  template <typename FmtT, typename... Args>
+  static std::enable_if_t<IsFormatString<FmtT>::value> Log(FmtT fmt,
+                                                           Args... args) {
+    Instance().logger_.Log(fmt, args...);
+  }
+
   static std::tuple<int, int, int> VersionToTuple(int version) {
     return Instance().VersionToTupleImpl(version);
   }
 
+  static TaskPool &Tasks() { return Instance().task_pool_; }
+
+  // Runs work on the task pool and passes its result (nothing, a value or a
+  // tuple of arguments) to the public `name` of the script on the server
+  // thread. Dropped if the script is unloaded in the meantime
+  template <typename Work>
+  static void RunAsync(ScriptT &script, const std::string &name, Work work) {
+    Tasks().Submit([work = std::move(work), amx = script.GetAmx(),
+                    name]() mutable -> TaskPool::Completion {
+      using Result = decltype(work());
+
+      if constexpr (std::is_void<Result>::value) {
+        work();
+
+        return [amx = std::move(amx), name = std::move(name)] {
+          if (amx->IsValid()) {
+            MakeAsyncPublic(amx, name).Exec();
+          }
+        };
+      } else {
+        return [result = work(), amx = std::move(amx),
+                name = std::move(name)]() mutable {
+          if (!amx->IsValid()) {
+            return;
+          }
+
+          Public pub = MakeAsyncPublic(amx, name);
+
+          if constexpr (IsTuple<Result>::value) {
+            std::apply([&pub](auto &...args) { pub.Exec(args...); }, result);
+          } else {
+            pub.Exec(result);
+          }
+        };
+      }
+    });
+  }
+
+  // Filled only when ProfileTicks() returns true
+  static const TickProfiler &GetTickProfiler() {
+    return Instance().tick_profiler_;
+  }
+
+  // Logs the call statistics collected with PTL_ENABLE_STATS, the most
+  // expensive natives and publics first
+  static void DumpStats(bool reset = false) {
+    if constexpr (!Stats::enabled) {
+      Log(PTL_FMT(
+          "stats are disabled, define PTL_ENABLE_STATS to collect them"));
+
+      return;
+    }
+
+    auto entries = Stats::Snapshot();
+
+    Log(PTL_FMT("stats: %d native(s) and public(s) called"),
+        static_cast<int>(entries.size()));
+
+    for (auto entry : entries) {
+      Log(PTL_FMT("%s %s: calls=%llu errors=%llu total=%.3fms avg=%.3fus "
+                  "max=%.3fus"),
+          entry->is_public ? "public" : "native", entry->name.c_str(),
+          static_cast<unsigned long long>(entry->calls),
+          static_cast<unsigned long long>(entry->errors),
+          entry->total_ns / 1e6, entry->total_ns / 1e3 / entry->calls,
+          entry->max_ns / 1e3);
+    }
+
+    if (reset) {
+      Stats::Reset();
+    }
+  }
+
+  static void ResetStats() { Stats::Reset(); }
+
+  // DumpStats as a native, registered by the plugin under its own name:
+  // RegisterNative<&Plugin::n_DumpStats>("PTL_DumpStats");
+  // native PTL_DumpStats(bool:reset = false);
+  static cell n_DumpStats(ScriptT &, cell reset) {
+    DumpStats(reset != 0);
+
+    return 1;
+  }
+
+  // Executes a public in every loaded script that has it, gamemode last.
+  // The per-script publics are re-resolved only when a script is loaded or
+  // unloaded, so a broadcast itself does no lookups and no allocations
+  template <typename... Args>
+  class PublicBroadcast {
+   public:
+    explicit PublicBroadcast(const std::string &name) : name_{name} {}
+
+    // Returns the value returned by the last script, like CallRemoteFunction
+    cell Exec(const Args &...args) { return ExecImpl<false>(0, args...); }
+
+    // Stops at the first script that returns stop_value and returns it
+    cell ExecUntil(cell stop_value, const Args &...args) {
+      return ExecImpl<true>(stop_value, args...);
+    }
+
+    inline const std::string &GetName() const { return name_; }
+
+   private:
+    template <bool stop_on_value>
+    cell ExecImpl(cell stop_value, const Args &...args) {
+      Refresh();
+
+      // A callback may load or unload scripts and run this broadcast again.
+      // The nested call then swaps in a new list, while this one keeps
+      // iterating its own snapshot
+      auto publics = publics_;
+      cell retval{};
+
+      for (auto &pub : *publics) {
+        if (!pub.GetAmx()->IsValid()) {
+          continue;  // unloaded by one of the previous callbacks
+        }
+
+        try {
+          retval = pub.Exec(ArgView(args)...);
+        } catch (const std::exception &e) {
+          PluginT::Log(PTL_FMT("%s: %s"), name_.c_str(), e.what());
+
+          continue;
+        }
+
+        if constexpr (stop_on_value) {
+          if (retval == stop_value) {
+            break;
+          }
+        }
+      }
+
+      return retval;
+    }
+
+    void Refresh() {
+      AbstractPlugin &plugin = PluginT::Instance();
+
+      if (generation_ == plugin.scripts_generation_) {
+        return;
+      }
+
+      auto publics = std::make_shared<std::vector<Public>>();
+
+      for (const auto &script : plugin.scripts_) {
+        int index = script->GetPublicIndex(name_);
+
+        if (index >= 0) {
+          publics->push_back(Public::FromIndex(name_, script->GetAmx(), index));
+        }
+      }
+
+      publics_ = std::move(publics);
+      generation_ = plugin.scripts_generation_;
+    }
+
+    template <typename T>
+    inline static auto ArgView(const T &arg) {
+      if constexpr (std::is_same<T, std::string>::value) {
+        return arg.c_str();
+      } else {
+        return arg;
+      }
+    }
+
+    std::string name_;
+    std::shared_ptr<std::vector<Public>> publics_;
+    std::size_t generation_{static_cast<std::size_t>(-1)};
+  };
+
   int Version() { return PACK_PLUGIN_VERSION(1, 0, 0); };  // 1.0.0
 
   const char *Name() { return typeid(PluginT).name(); };
 
   bool LogAmxErrors() { return true; };
 
+  // Max AMX error messages a second per (function or public, error code),
+  // the rest are counted and reported as suppressed repeats once a second.
+  // 0 - unlimited
+  int AmxErrorLogRate() { return 0; };
+
+  // Amx does amx_GetAddr, amx_Push, amx_Release and amx_StrLen itself
+  // instead of calling the exports. Faster, but hooks other plugins install
+  // on those exports are bypassed
+  bool InlineAmxCalls() { return false; };
+
+  // Logs the natives each script still lacks once this plugin has
+  // registered its own. The check is script-wide: natives of the plugins
+  // loaded after this one are not registered yet and are listed too
+  bool LogUnresolvedNatives() { return false; };
+
+  // Log messages are queued and written on the next ProcessTick, natives
+  // and worker threads never wait for logprintf
+  bool AsyncLogging() { return false; };
+
+  // Worker threads of the task pool, started by the first RunAsync/Submit
+  int TaskThreads() { return 2; };
+
+  // Measures every OnProcessTick and logs a histogram summary
+  bool ProfileTicks() { return false; };
+
+  // Ticks longer than this are reported once a second (0 - disabled)
+  int TickBudgetUs() { return 0; };
+
+  // How often the tick percentiles are logged (0 - never)
+  int TickSummarySeconds() { return 60; };
+
+  // kRaise makes malformed native calls cheap, but aborts the calling script
+  NativeParamErrors NativeParamErrorMode() {
+    return NativeParamErrors::kThrow;
+  };
+
   bool OnLoad() {
-    Log("plugin v%s loaded", VersionAsString().c_str());
+    Log(PTL_FMT("plugin v%s loaded"), VersionAsString().c_str());
 
     return true;
   }
 
-  void OnUnload() { Log("plugin unloaded"); }
+  void OnUnload() { Log(PTL_FMT("plugin unloaded")); }
 
   void OnProcessTick() {}
 
@@ -731,13 +3789,13 @@ class AbstractPlugin {
   template <auto func, bool expand_params = true>
   void RegisterNative(const char *name) {
     if constexpr (std::is_member_function_pointer<decltype(func)>::value) {
-      natives_[name] =
-          NativeGenerator<decltype(func), func, expand_params>::Native;
+      RegisterNativeImpl<NativeGenerator<decltype(func), func, expand_params>>(
+          name);
     } else {
-      natives_[name] = NativeGenerator<
+      RegisterNativeImpl<NativeGenerator<
           typename std::add_pointer<
               typename std::remove_pointer<decltype(func)>::type>::type,
-          func, expand_params>::Native;
+          func, expand_params>>(name);
     }
   }
 
@@ -747,19 +3805,33 @@ class AbstractPlugin {
 
   template <typename... Args, auto func, bool expand_params>
   struct NativeGenerator<cell (*)(ScriptT &, Args...), func, expand_params> {
+    inline static std::string name{"(unknown native)"};
+    inline static CallStats *stats{};
+
     template <std::size_t... index>
-    inline static cell Call(ScriptT &script, cell *params,
+    inline static cell Call(ScriptT &script, [[maybe_unused]] cell *params,
                             std::index_sequence<index...>) {
-      return func(script, script.template PrepareNativeParam<NativeParamT>(
-                              params[index + 1])...);
+      [[maybe_unused]] constexpr auto offsets = NativeParamOffsets<Args...>();
+
+      return func(script, PassNativeArg<Args>(MakeNativeArg<Args>(
+                              script, params + offsets[index] + 1))...);
     }
 
     static cell AMX_NATIVE_CALL Native(AMX *amx, cell *params) {
+      CallTimer timer{stats};
+
       try {
         auto &script = PluginT::GetScript(amx);
+        ScratchArena::Scope scratch_scope{script.Scratch()};
 
         if constexpr (expand_params) {
-          script.AssertParams(sizeof...(Args), params);
+          if (!CheckNativeParams<Args...>(
+                  script, params, name,
+                  std::make_index_sequence<sizeof...(Args)>{})) {
+            timer.Fail();
+
+            return 0;
+          }
 
           return Call(script, params,
                       std::make_index_sequence<sizeof...(Args)>{});
@@ -767,8 +3839,9 @@ class AbstractPlugin {
           return func(script, params);
         }
       } catch (const std::exception &e) {
-        PluginT::Log("%s: %s", PluginT::GetNativeName(Native).c_str(),
-                     e.what());
+        timer.Fail();
+
+        PluginT::Log(PTL_FMT("%s: %s"), name.c_str(), e.what());
       }
 
       return 0;
@@ -777,19 +3850,33 @@ class AbstractPlugin {
 
   template <typename... Args, auto func, bool expand_params>
   struct NativeGenerator<cell (ScriptT::*)(Args...), func, expand_params> {
+    inline static std::string name{"(unknown native)"};
+    inline static CallStats *stats{};
+
     template <std::size_t... index>
-    inline static cell Call(ScriptT &script, cell *params,
+    inline static cell Call(ScriptT &script, [[maybe_unused]] cell *params,
                             std::index_sequence<index...>) {
-      return (script.*func)(script.template PrepareNativeParam<NativeParamT>(
-          params[index + 1])...);
+      [[maybe_unused]] constexpr auto offsets = NativeParamOffsets<Args...>();
+
+      return (script.*func)(PassNativeArg<Args>(
+          MakeNativeArg<Args>(script, params + offsets[index] + 1))...);
     }
 
     static cell AMX_NATIVE_CALL Native(AMX *amx, cell *params) {
+      CallTimer timer{stats};
+
       try {
         auto &script = PluginT::GetScript(amx);
+        ScratchArena::Scope scratch_scope{script.Scratch()};
 
         if constexpr (expand_params) {
-          script.AssertParams(sizeof...(Args), params);
+          if (!CheckNativeParams<Args...>(
+                  script, params, name,
+                  std::make_index_sequence<sizeof...(Args)>{})) {
+            timer.Fail();
+
+            return 0;
+          }
 
           return Call(script, params,
                       std::make_index_sequence<sizeof...(Args)>{});
@@ -797,14 +3884,154 @@ class AbstractPlugin {
           return (script.*func)(params);
         }
       } catch (const std::exception &e) {
-        PluginT::Log("%s: %s", PluginT::GetNativeName(Native).c_str(),
-                     e.what());
+        timer.Fail();
+
+        PluginT::Log(PTL_FMT("%s: %s"), name.c_str(), e.what());
       }
 
       return 0;
     }
   };
 
+  // Validates the parameters of a generated native. Malformed calls are
+  // reported according to NativeParamErrorMode()
+  template <typename... Args, std::size_t... index>
+  inline static bool CheckNativeParams(ScriptT &script, cell *params,
+                                       const std::string &native_name,
+                                       std::index_sequence<index...>) {
+    constexpr auto offsets = NativeParamOffsets<Args...>();
+    constexpr std::size_t count = offsets[sizeof...(Args)];
+
+    if (static_cast<ucell>(params[0]) != (count * sizeof(cell))) {
+      return NativeParamError(script, native_name,
+                              PTL_FMT("Number of parameters must be equal to "
+                                      "%d"),
+                              static_cast<int>(count));
+    }
+
+    return (CheckNativeParam<Args>(script, params + offsets[index] + 1,
+                                   native_name, offsets[index] + 1) &&
+            ...);
+  }
+
+  // Throws like AssertParams or, with NativeParamErrors::kRaise, logs a
+  // preformatted message and raises AMX_ERR_PARAMS without any unwinding.
+  // Always returns false
+  template <typename FmtT, typename... Args>
+  static bool NativeParamError(ScriptT &script, const std::string &native_name,
+                               FmtT, Args... args) {
+    AssertFormat<FmtT, Args...>();
+
+    char message[128];
+
+    std::snprintf(message, sizeof(message), FmtT::Get(), args...);
+
+    if (Instance().native_param_errors_ == NativeParamErrors::kThrow) {
+      throw std::runtime_error{message};
+    }
+
+    script.GetAmx()->RaiseError(AMX_ERR_PARAMS);
+
+    PluginT::Log(PTL_FMT("%s: %s"), native_name.c_str(), message);
+
+    return false;
+  }
+
+  // offsets[i] is the index of the first cell of the i-th argument in params
+  // (without the count), offsets[sizeof...(Args)] is the total cell count
+  template <typename... Args>
+  static constexpr std::array<std::size_t, sizeof...(Args) + 1>
+  NativeParamOffsets() {
+    std::array<std::size_t, sizeof...(Args) + 1> offsets{};
+    std::size_t widths[] = {NativeParamWidth<std::decay_t<Args>>::value...,
+                            0};
+
+    for (std::size_t i = 0; i < sizeof...(Args); ++i) {
+      offsets[i + 1] = offsets[i] + widths[i];
+    }
+
+    return offsets;
+  }
+
+  template <typename T>
+  inline static auto MakeNativeArg(ScriptT &script, cell *param) {
+    using Arg = std::decay_t<T>;
+
+    if constexpr (IsHandle<Arg>::value) {
+      using Object = typename IsHandle<Arg>::Object;
+
+      return Arg{*param, *HandleTable<Object>::Instance().Get(*param)};
+    } else if constexpr (IsSpan<Arg>::value) {
+      using Element = typename IsSpan<Arg>::Element;
+
+      return Arg{reinterpret_cast<Element *>(script.GetPhysAddr(param[0])),
+                 static_cast<std::size_t>(param[1])};
+    } else if constexpr (std::is_same<Arg, OutString>::value) {
+      return OutString{script.GetPhysAddr(param[0]),
+                       static_cast<std::size_t>(param[1])};
+    } else {
+      return script.template PrepareNativeParam<NativeParamT>(*param);
+    }
+  }
+
+  // Parameters taken by non-const reference (Span<T> &, OutString &, ...)
+  // bind to the temporary made by MakeNativeArg, which lives until the
+  // native returns
+  template <typename T, typename U>
+  inline static decltype(auto) PassNativeArg(U &&arg) {
+    if constexpr (std::is_lvalue_reference<T>::value) {
+      return static_cast<U &>(arg);
+    } else {
+      return std::forward<U>(arg);
+    }
+  }
+
+  template <typename T>
+  inline static bool CheckNativeParam(ScriptT &script, cell *param,
+                                      const std::string &native_name,
+                                      std::size_t index) {
+    using Arg = std::decay_t<T>;
+    using Pointee = typename std::remove_cv<
+        typename std::remove_pointer<T>::type>::type;
+
+    if constexpr (IsHandle<Arg>::value) {
+      using Object = typename IsHandle<Arg>::Object;
+
+      if (!HandleTable<Object>::Instance().Contains(*param)) {
+        return NativeParamError(script, native_name,
+                                PTL_FMT("Parameter %d is an invalid handle "
+                                        "(%d)"),
+                                static_cast<int>(index), *param);
+      }
+    }
+
+    if constexpr (IsSpan<Arg>::value ||
+                  std::is_same<Arg, OutString>::value) {
+      if (!script.IsValidRange(param[0], param[1])) {
+        return NativeParamError(
+            script, native_name,
+            PTL_FMT("Parameters %d-%d are an invalid array"),
+            static_cast<int>(index), static_cast<int>(index + 1));
+      }
+    }
+
+    // Only the built-in reference and string conversions, custom
+    // NativeParam conversions may use the cell as something other than an
+    // address
+    if constexpr ((std::is_pointer<T>::value &&
+                   (std::is_same<Pointee, cell>::value ||
+                    std::is_same<Pointee, float>::value)) ||
+                  IsStringParam<Arg>::value) {
+      if (!script.IsValidAddr(*param)) {
+        return NativeParamError(script, native_name,
+                                PTL_FMT("Parameter %d is an invalid address"),
+                                static_cast<int>(index));
+      }
+    }
+
+    return true;
+  }
+
   AbstractPlugin() = default;
   AbstractPlugin(const AbstractPlugin &) = delete;
   AbstractPlugin(AbstractPlugin &&) = delete;
@@ -817,40 +4044,66 @@ class AbstractPlugin {
     logprintf_ =
         reinterpret_cast<LogPrintf>(plugin_data_[PLUGIN_DATA_LOGPRINTF]);
 
+    logger_.SetLogPrintf(logprintf_);
+
+    amx_api_.Load(plugin_data_[PLUGIN_DATA_AMX_EXPORTS]);
+
     impl_ = static_cast<PluginT *>(this);
 
     try {
       name_ = impl_->Name();
       version_ = impl_->Version();
 
-      Log("plugin v%s loading...", VersionAsString().c_str());
+      logger_.SetName(name_);
+
+      Log(PTL_FMT("plugin v%s loading..."), VersionAsString().c_str());
 
       bool loaded = impl_->OnLoad();
 
       log_amx_errors_ = impl_->LogAmxErrors();
+      amx_error_log_rate_ = impl_->AmxErrorLogRate();
+      log_unresolved_natives_ = impl_->LogUnresolvedNatives();
+      profile_ticks_ = impl_->ProfileTicks();
+      native_param_errors_ = impl_->NativeParamErrorMode();
+      amx_api_.inline_calls = impl_->InlineAmxCalls();
+
+      task_pool_.SetThreads(impl_->TaskThreads());
+
+      logger_.SetAsync(impl_->AsyncLogging());
+
+      if (profile_ticks_) {
+        tick_profiler_.Start(impl_->TickBudgetUs(),
+                             impl_->TickSummarySeconds());
+      }
 
       return loaded;
     } catch (const std::exception &e) {
-      Log("%s: %s", __func__, e.what());
+      Log(PTL_FMT("%s: %s"), __func__, e.what());
     }
 
     return false;
   }
 
   inline void DoUnloadImpl() {
+    task_pool_.Stop();
+
     try {
       impl_->OnUnload();
     } catch (const std::exception &e) {
-      Log("%s: %s", __func__, e.what());
+      Log(PTL_FMT("%s: %s"), __func__, e.what());
     }
+
+    logger_.Flush();
   }
 
   inline void DoAmxLoadImpl(AMX *amx) {
+    ScratchArena::Scope scratch_scope{scratch_};
+
     try {
       auto script = std::make_shared<ScriptT>();
 
-      script->Init(amx, plugin_data_[PLUGIN_DATA_AMX_EXPORTS], log_amx_errors_,
-                   logprintf_, name_);
+      script->Init(amx, amx_api_, log_amx_errors_, amx_error_log_rate_,
+                   logger_, scratch_);
 
       if (script->HasVersion() && script->GetVersion() != version_) {
         throw std::runtime_error{"Mismatch between the plugin (" +
@@ -859,8 +4112,31 @@ class AbstractPlugin {
                                  ") versions"};
       }
 
-      for (auto &[native_name, native_func] : natives_) {
-        script->RegisterNative(native_name.c_str(), native_func);
+      if (native_list_.empty()) {
+        for (auto &[native_name, native_func] : natives_) {
+          native_list_.push_back({native_name.c_str(), native_func});
+        }
+      }
+
+      if (!native_list_.empty()) {
+        script->RegisterNatives(native_list_.data(),
+                                static_cast<int>(native_list_.size()));
+      }
+
+      if (log_unresolved_natives_) {
+        auto unresolved = script->GetUnresolvedNatives();
+
+        if (!unresolved.empty()) {
+          std::string names;
+
+          for (auto &name : unresolved) {
+            names += (names.empty() ? "" : ", ") + name;
+          }
+
+          Log(PTL_FMT("script has %d native(s) not registered by this or an "
+                      "earlier plugin: %s"),
+              static_cast<int>(unresolved.size()), names.c_str());
+        }
       }
 
       if (!script->OnLoad()) {
@@ -871,6 +4147,9 @@ class AbstractPlugin {
           std::any_of(scripts_.begin(), scripts_.end(),
                       [](const auto &script) { return script->IsGamemode(); });
 
+      script_index_[amx] = script;
+      ++scripts_generation_;
+
       if (script->IsGamemode()) {
         scripts_.push_back(script);
 
@@ -887,11 +4166,29 @@ class AbstractPlugin {
         }
       }
     } catch (const std::exception &e) {
-      Log("%s: %s", __func__, e.what());
+      Log(PTL_FMT("%s: %s"), __func__, e.what());
     }
   }
 
   inline void DoAmxUnloadImpl(AMX *amx) {
+    if (last_amx_ == amx) {
+      last_amx_ = nullptr;
+      last_script_ = nullptr;
+    }
+
+    HandleTableBase::ReleaseAllOwnedBy(amx);
+
+    auto indexed = script_index_.find(amx);
+
+    if (indexed == script_index_.end()) {
+      return;
+    }
+
+    indexed->second->GetAmx()->Invalidate();
+
+    script_index_.erase(indexed);
+    ++scripts_generation_;
+
     auto script = std::find_if(scripts_.begin(), scripts_.end(),
                                [amx](auto &script) { return *script == amx; });
 
@@ -901,22 +4198,76 @@ class AbstractPlugin {
   }
 
   inline void DoProcessTickImpl() {
+    std::uint64_t start = profile_ticks_ ? TickProfiler::Now() : 0;
+
+    logger_.Flush();
+
     try {
+      // Covers the completions and OnProcessTick, which run outside natives
+      ScratchArena::Scope scratch_scope{scratch_};
+
+      task_pool_.Drain(
+          [](const char *error) { Log(PTL_FMT("task: %s"), error); });
+
       impl_->OnProcessTick();
     } catch (const std::exception &e) {
-      Log("%s: %s", __func__, e.what());
+      Log(PTL_FMT("%s: %s"), __func__, e.what());
     }
+
+    if (amx_error_log_rate_ > 0) {
+      LogSuppressedErrors();
+    }
+
+    if (profile_ticks_) {
+      std::uint64_t end = TickProfiler::Now();
+
+      if (tick_profiler_.Record(start, end)) {
+        tick_profiler_.Report(end, [this](const char *fmt, auto... args) {
+          LogImpl(fmt, args...);
+        });
+      }
+    }
+  }
+
+  // Reports the repeats held back by AmxErrorLogRate() once a second, so a
+  // burst of errors that stops is not only reported at unload
+  inline void LogSuppressedErrors() {
+    auto now = std::chrono::steady_clock::now();
+
+    if (now - suppressed_errors_logged_ < std::chrono::seconds{1}) {
+      return;
+    }
+
+    suppressed_errors_logged_ = now;
+
+    for (const auto &script : scripts_) {
+      script->GetAmx()->LogSuppressedErrors();
+    }
+  }
+
+  // Public of a still loaded script, for the RunAsync completions
+  inline static Public MakeAsyncPublic(const std::shared_ptr<Amx> &amx,
+                                       const std::string &name) {
+    return Public::FromIndex(name, amx,
+                             GetScript(amx->GetPtr()).GetPublicIndex(name));
   }
 
   inline ScriptT &GetScriptImpl(AMX *amx) {
-    auto script = std::find_if(scripts_.begin(), scripts_.end(),
-                               [amx](auto &script) { return *script == amx; });
+    // Natives are usually called from the same script many times in a row
+    if (amx == last_amx_) {
+      return *last_script_;
+    }
+
+    auto script = script_index_.find(amx);
 
-    if (script == scripts_.end()) {
+    if (script == script_index_.end()) {
       throw std::runtime_error{"Script not found"};
     }
 
-    return **script;
+    last_amx_ = amx;
+    last_script_ = script->second.get();
+
+    return *last_script_;
   }
 
   inline bool EveryScriptImpl(
@@ -935,26 +4286,30 @@ class AbstractPlugin {
   }
 
   inline std::string GetNativeNameImpl(AMX_NATIVE func) {
-    for (auto &[native_name, native_func] : natives_) {
-      if (func == native_func) {
-        return native_name;
-      }
+    auto native_name = native_names_.find(func);
+
+    if (native_name == native_names_.end()) {
+      return "(unknown native)";
     }
 
-    return "(unknown native)";
+    return native_name->second;
+  }
+
+  // Every NativeGenerator instantiation carries its own name, so generated
+  // natives never have to look it up
+  template <typename Generator>
+  inline void RegisterNativeImpl(const char *name) {
+    Generator::name = name;
+    Generator::stats = Stats::Native(name);
+
+    natives_[name] = Generator::Native;
+    native_list_.clear();
+    native_names_[Generator::Native] = name;
   }
 
   template <typename... Args>
   inline void LogImpl(const std::string &fmt, Args... args) {
-    if (!logprintf_) {
-      throw std::runtime_error{"logprintf_ is null"};
-    }
-
-    if (name_.empty()) {
-      logprintf_(fmt.c_str(), args...);
-    } else {
-      logprintf_(("[%s] " + fmt).c_str(), name_.c_str(), args...);
-    }
+    logger_.Log(fmt.c_str(), args...);
   }
 
   inline std::string VersionToString(int version) const {
@@ -975,12 +4330,28 @@ class AbstractPlugin {
     return std::make_tuple(major, minor, patch);
   }
 
-  std::list<std::shared_ptr<ScriptT>> scripts_;
+  std::list<std::shared_ptr<ScriptT>> scripts_;  // gamemode at the end
+  std::unordered_map<AMX *, std::shared_ptr<ScriptT>> script_index_;
+  std::size_t scripts_generation_{};
+  AMX *last_amx_{};
+  ScriptT *last_script_{};
   std::unordered_map<std::string, AMX_NATIVE> natives_;
+  std::unordered_map<AMX_NATIVE, std::string> native_names_;
+  std::vector<AMX_NATIVE_INFO> native_list_;  // registered with one call
 
   void **plugin_data_{};
+  AmxApi amx_api_;
   LogPrintf logprintf_{};
+  Logger logger_;
   bool log_amx_errors_{};
+  int amx_error_log_rate_{};
+  std::chrono::steady_clock::time_point suppressed_errors_logged_;
+  bool log_unresolved_natives_{};
+  bool profile_ticks_{};
+  NativeParamErrors native_param_errors_{};
+  TickProfiler tick_profiler_;
+  TaskPool task_pool_;
+  ScratchArena scratch_;
 
   std::string name_;
   int version_{};